@@ -1,4 +1,7 @@
 
+#ifdef LINUX
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -9,13 +12,123 @@
 #include <time.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SIMD_SCAN
+#endif
 #include "libsuperlog.h"
-#include <sys/select.h>
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#else
+#include <poll.h>
+#endif
 
 static bool superlog_enabled = false;
 static int log_fd = -1;
 static FILE *ofile = NULL;
 
+int superlog_flush_ms = 0;
+
+/* Growable buffer, used for formatting and packing messages */
+typedef struct {
+    char *buf;
+    size_t len, size;
+    char *stack;        /* Initial buffer, not to be freed */
+} Buf;
+
+static bool bufGrow(Buf *b, size_t more);
+static void bufPut(Buf *b, const void *data, size_t len);
+static void bufPrintf(Buf *b, const char *fmt, va_list ap);
+
+/*
+ * Every line a client sends starts with TID_START, the sending
+ * thread's id in decimal, and TID_END. The parent strips this off.
+ */
+#define TID_START       '\036'
+#define TID_END         '\037'
+
+static long threadId();
+static void tagLines(Buf *out, const char *text, size_t len, bool *bol);
+static void tbWrite(const char *data, size_t len);
+
+/*
+ * Optional shared memory transport. The parent creates the ring
+ * before forking and passes its fd, and an fd for wakeups, to the
+ * child in the environment. Clients reserve space with a
+ * compare-and-swap on 'reserve', fill in the record, and publish it
+ * by storing the record's own position in its 'stamp'. The parent
+ * consumes records in order, stopping at the first unpublished one.
+ * Positions increase forever; the offset in data[] is pos % size.
+ */
+
+#define SHM_ENV         "SUPERLOG_SHM"
+#define SHM_MAGIC       0x53686d52      /* "ShmR" */
+#define SHM_ALIGN       16
+#define SHM_SIZE(len)   \
+	((sizeof(ShmRec) + (len) + SHM_ALIGN-1) & ~(SHM_ALIGN-1))
+
+enum { SHM_PAD, SHM_TEXT, SHM_FMT, SHM_DEFERRED };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;              /* Bytes in data[] */
+    _Atomic uint64_t dropped;   /* Records lost to a full ring */
+    char pad1[48];
+    _Atomic uint64_t reserve;   /* Next position to hand out */
+    char pad2[56];
+    _Atomic uint64_t tail;      /* Everything before this is consumed */
+    char pad3[56];
+    char data[];
+} ShmRing;
+
+typedef struct {
+    _Atomic uint64_t stamp;     /* Set to the record's position to publish */
+    uint32_t len;               /* Length of the payload that follows */
+    int16_t fd;
+    uint16_t kind;
+} ShmRec;
+
+static ShmRing *shmOut = NULL;  /* Client side */
+static int shmWakeOut = -1;
+
+static void shmAttach();
+static bool shmPut(int kind, short fd, const char *buf, size_t len);
+
+/* One conversion in a deferred format string */
+typedef struct {
+    char type;          /* Argument type, see fmtSpec() */
+    bool wstar;         /* Width is an int argument */
+    bool pstar;         /* Precision is an int argument */
+    int prec;           /* Literal precision, or -1 */
+} FmtSpec;
+
+/* A format string registered with superlogFormat() */
+struct SuperlogFormat {
+    const char *fmt;
+    uint64_t key;               /* Identifies it to the parent */
+    _Atomic bool sent;          /* Parent has been told about it */
+    bool ok;                    /* Can be deferred */
+    int nspec;
+    FmtSpec specs[];
+};
+
+static int fmtParse(const char *fmt, FmtSpec *specs);
+
 #pragma mark -- client utilities --
 
 /**
@@ -25,6 +138,8 @@ static FILE *ofile = NULL;
 void
 superlogInit(int fd)
 {
+	static bool registered = false;
+
 	/* See if fd is open for output */
 	if (fcntl(fd, F_GETFD) < 0) {
 		superlog_enabled = false;
@@ -32,10 +147,13 @@ superlogInit(int fd)
 		return;
 	}
 	log_fd = fd;
-	ofile = fdopen(fd, "w");
-	fprintf(ofile, "Superlog output begins\n");
-	fflush(ofile);
 	superlog_enabled = true;
+	shmAttach();
+	if (!registered) {
+		atexit(superlogFlush);
+		registered = true;
+	}
+	superlog("Superlog output begins\n");
 }
 
 /**
@@ -49,8 +167,7 @@ superlog(const char *fmt, ...)
 	if (!superlog_enabled) return;
 
 	va_start(ap, fmt);
-	vfprintf(ofile, fmt, ap);
-	fflush(ofile);
+	vsuperlog(fmt, ap);
 	va_end(ap);
 }
 
@@ -60,10 +177,28 @@ superlog(const char *fmt, ...)
 void
 vsuperlog(const char *fmt, va_list ap)
 {
+	static _Thread_local bool bol = true;
+	char msgbuf[1024], outbuf[1024];
+	Buf msg = {msgbuf, 0, sizeof(msgbuf), msgbuf};
+	Buf out = {outbuf, 0, sizeof(outbuf), outbuf};
+	bool shmbol = true;
+
 	if (!superlog_enabled) return;
 
-	vfprintf(ofile, fmt, ap);
-	fflush(ofile);
+	bufPrintf(&msg, fmt, ap);
+	if (shmOut != NULL) {
+		/* The parent splits each ring record into lines itself */
+		tagLines(&out, msg.buf, msg.len, &shmbol);
+		if (out.len > 0)
+			shmPut(SHM_TEXT, log_fd, out.buf, out.len);
+	} else {
+		tagLines(&out, msg.buf, msg.len, &bol);
+		tbWrite(out.buf, out.len);
+	}
+	if (msg.buf != msg.stack)
+		free(msg.buf);
+	if (out.buf != out.stack)
+		free(out.buf);
 }
 
 /**
@@ -72,753 +207,6570 @@ vsuperlog(const char *fmt, va_list ap)
 void
 superlogDump()
 {
+	superlogFlush();
 	kill(getppid(), SIGUSR1);
 }
 
+static bool
+bufGrow(Buf *b, size_t more)
+{
+	char *tmp;
+	size_t size;
 
-#pragma mark -- superlog --
+	if (b->len + more <= b->size) return true;
+	for (size = b->size > 0 ? b->size * 2 : 256; size < b->len + more;)
+	    size *= 2;
+	if (b->buf == b->stack) {
+	    if ((tmp = malloc(size)) != NULL)
+		memcpy(tmp, b->buf, b->len);
+	} else {
+	    tmp = realloc(b->buf, size);
+	}
+	if (tmp == NULL) return false;
+	b->buf = tmp;
+	b->size = size;
+	return true;
+}
 
+static void
+bufPut(Buf *b, const void *data, size_t len)
+{
+	if (!bufGrow(b, len)) return;
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+}
 
-/* Definitions, typedefs, forward references, globals, macros */
+static void
+bufPrintf(Buf *b, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int len;
 
-#define	MAX_BUFFERS	8
-#define	MAX_TRIGGERS 20
+	va_copy(aq, ap);
+	len = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+	if (len >= 0 && b->len + len >= b->size && bufGrow(b, len + 1))
+		vsnprintf(b->buf + b->len, len + 1, fmt, aq);
+	va_end(aq);
+	if (len > 0 && b->len + len < b->size)
+		b->len += len;
+}
 
-bool timestamps = false;
-bool showfds = false;
-bool verbose = false;
-enum colorize showcolor = NONE;
+/**
+ * Copy text to out, starting each line with the thread id tag.
+ * *bol says whether text starts a new line, and is updated.
+ */
+static void
+tagLines(Buf *out, const char *text, size_t len, bool *bol)
+{
+	static _Thread_local char tag[32];
+	static _Thread_local long tagTid;
+	static _Thread_local int taglen;
+	const char *end = text + len, *nl;
 
-struct LogMsg {
-    struct LogMsg *next;
-    long seq;
-    time_t time;
-    short linelen;
-    short fd;
-    char type;
-    char line[1];
-};
+	if (tagTid != threadId()) {
+		tagTid = threadId();
+		taglen = snprintf(tag, sizeof(tag), "%c%ld%c",
+		    TID_START, tagTid, TID_END);
+	}
+	while (text < end) {
+		if (*bol)
+			bufPut(out, tag, taglen);
+		nl = memchr(text, '\n', end - text);
+		nl = nl != NULL ? nl + 1 : end;
+		bufPut(out, text, nl - text);
+		*bol = nl[-1] == '\n';
+		text = nl;
+	}
+}
 
-struct  LogBuffer {
-    long limit;		/* Max allowed */
-    const char *pat;	/* Pattern for logs in this buffer */
-    LogMsg *first;	/* Start of linked list of messages */
-    LogMsg **last;	/* End of the list */
-    LogMsg *end;	/* Last one written */
-    long allocated;	/* How much space consumed so far */
-    bool full;		/* No more allocations */
-    char type;
-    LogMsg *iter;	/* Iterator */
-};
+/**
+ * Return the calling thread's id.
+ */
+static long
+threadId()
+{
+	static _Thread_local long tid;
+	static _Thread_local pid_t pid;
 
+	/* Recompute after a fork */
+	if (tid == 0 || pid != getpid()) {
+		pid = getpid();
+#if defined(LINUX)
+		tid = syscall(SYS_gettid);
+#elif defined(__APPLE__)
+		uint64_t id;
+		pthread_threadid_np(NULL, &id);
+		tid = id;
+#else
+		tid = (long)pthread_self();
+#endif
+	}
+	return tid;
+}
 
-typedef struct nbfile NBFile;
 
-static int numTrigger = 0;
+#pragma mark -- Shared memory ring --
 
-static void child(int fds[MAX_FDS], int pfds[MAX_FDS][2], int nfds,
-  char **args, int argc, int (*func)(int argc, char **argv));
-static const char *timeStr(time_t t);
-static void LogBufferInit(LogBuffer *lb);
-static LogBuffer * classify(const char *line);
-static void LogBufferIterator(LogBuffer *lb);
-static LogMsg *LogBufferNext(LogBuffer *lb);
-static LogMsg * lmAlloc(size_t len);
-static const char * colorStart(char type, int fd);
-static const char * colorStop();
-static void nonBlocking(int fd);
-static NBFile * NBFileOpen(int fd);
-static char *NBFileRead(NBFile *file);
+/**
+ * If the parent set up a shared memory ring, map it.
+ */
+static void
+shmAttach()
+{
+    const char *env = getenv(SHM_ENV);
+    int shmfd, wakefd;
+    struct stat st;
+    ShmRing *ring;
 
-#define	NA(a)	(sizeof(a)/sizeof(a[0]))
+    if (env == NULL || sscanf(env, "%d,%d", &shmfd, &wakefd) != 2)
+	return;
+    if (fstat(shmfd, &st) < 0 || st.st_size < sizeof(ShmRing))
+	return;
+    ring = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, shmfd, 0);
+    if (ring == MAP_FAILED)
+	return;
+    if (ring->magic != SHM_MAGIC ||
+	ring->size + sizeof(ShmRing) > st.st_size)
+    {
+	munmap(ring, st.st_size);
+	return;
+    }
+    shmOut = ring;
+    shmWakeOut = wakefd;
+}
 
+/**
+ * Tell the other side there's something to look at.
+ */
+static void
+shmWake(int fd)
+{
+#ifdef LINUX
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+#else
+    char c = 0;
+    write(fd, &c, 1);
+#endif
+}
 
 /**
- * This is the usual main entry point to superlog.
- *
- * @param fds - array of child output file descriptors to read from
- * @param nfds - number of file descriptors in fds
- * @param argv - arguments (NULL-terminated) to pass to child
- * @param func - main() function to call, or NULL
- * @param ofilename - name of file to receive logs, or NULL for stdout
- *
- * If func() is not specified, this function will execute the program
- * specified in argv[0]. If func() is specified, this function will fork
- * and then execute func(argc, argv)
+ * Publish one record. If the ring stays full for about a second,
+ * the record is dropped and counted. Returns true on success.
  */
-int
-SuperLog(
-    int *fds,
-    int nfds,
-    char **argv,
-    int (*func)(int argc, char **argv),
-    const char *ofilename
-)
+static bool
+shmPut(int kind, short fd, const char *buf, size_t len)
 {
-    int pfds[MAX_FDS][2];
-    int ifds[MAX_FDS];
-    int i;
-    int pid;
-    int argc;
-    char **tmp;
+    ShmRing *ring = shmOut;
+    uint64_t pos, start, tail;
+    uint32_t off, size = SHM_SIZE(len), need;
+    ShmRec *rec;
+    int tries = 0;
 
-    ofile = stdout;
+    if (size > ring->size) {
+	atomic_fetch_add(&ring->dropped, 1);
+	return false;
+    }
 
-    if (ofilename != NULL) {
-	if ((ofile = fopen(ofilename, "w")) == NULL) {
-	    perror(ofilename);
-	    return 4;
+    /* Reserve space. A record never straddles the end of the ring,
+     * so if it won't fit, reserve the rest of the ring as padding.
+     */
+    pos = atomic_load(&ring->reserve);
+    for (;;) {
+	off = pos % ring->size;
+	need = off + size > ring->size ? ring->size - off + size : size;
+	tail = atomic_load(&ring->tail);
+	if (pos + need - tail > ring->size) {
+	    if (++tries > 10000) {
+		atomic_fetch_add(&ring->dropped, 1);
+		return false;
+	    }
+	    if (tries > 100) {
+		struct timespec ts = {0, 100000};
+		nanosleep(&ts, NULL);
+	    } else {
+		sched_yield();
+	    }
+	    pos = atomic_load(&ring->reserve);
+	    continue;
 	}
+	if (atomic_compare_exchange_weak(&ring->reserve, &pos, pos + need))
+	    break;
     }
 
-    for (argc=0, tmp=argv; *tmp != NULL; ++tmp, ++argc);
-
-    if (nfds > MAX_FDS) {
-	fprintf(stderr, "Limit of %d output fds, extras ignored\n", MAX_FDS);
-	nfds = MAX_FDS;
+    start = pos;
+    if (need != size) {
+	rec = (ShmRec *)(ring->data + off);
+	rec->len = ring->size - off - sizeof(*rec);
+	rec->fd = -1;
+	rec->kind = SHM_PAD;
+	atomic_store_explicit(&rec->stamp, pos, memory_order_release);
+	pos += ring->size - off;
     }
+    rec = (ShmRec *)(ring->data + pos % ring->size);
+    rec->len = len;
+    rec->fd = fd;
+    rec->kind = kind;
+    memcpy(rec + 1, buf, len);
+    atomic_store_explicit(&rec->stamp, pos, memory_order_release);
 
-    /* Set up the pipes */
-    for (i=0; i<nfds; ++i) {
-	if (pipe(pfds[i]) < 0) {
-	    perror("pipe");
-	    return 3;
-	}
-	ifds[i] = pfds[i][0];
-    }
+    /* If the parent has caught up to us, it's waiting to be woken */
+    atomic_thread_fence(memory_order_seq_cst);
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail >= start && tail <= pos)
+	shmWake(shmWakeOut);
+    return true;
+}
 
-    if ((pid = fork()) < 0) {
-	perror("fork");
-	return 3;
-    }
+#pragma mark -- Thread batching --
 
-    if (pid == 0) {
-	child(fds, pfds, nfds, argv, argc, func);
-	fprintf(stderr, "exec failed\n");
-	_exit(3);
-    }
+/*
+ * When the pipe is used, each thread collects its messages in its own
+ * buffer and sends them in a single write() of at most PIPE_BUF bytes,
+ * which the kernel won't interleave with other writers. A buffer is
+ * written when the next message won't fit, when its oldest message is
+ * superlog_flush_ms old, on superlogFlush() or superlogDump(), and
+ * when the thread or process exits. A background thread takes care of
+ * threads that have gone quiet. This is off unless superlog_flush_ms
+ * is set, since a child that crashes loses what's still buffered.
+ */
 
-    /* Parent */
-    LogParent(fds, ifds, nfds);
-    printf("Finished, dumping logs\n");
-    LogDump();
+typedef struct TBuf {
+    struct TBuf *next;
+    pthread_mutex_t lock;
+    struct timespec first;      /* When the oldest message was added */
+    size_t len;
+    char buf[PIPE_BUF];
+} TBuf;
 
-    return 0;
-}
+static pthread_mutex_t tbLock = PTHREAD_MUTEX_INITIALIZER; /* For tbList */
+static TBuf *tbList = NULL;
+static _Atomic bool tbFlusherRunning = false;
+static pthread_key_t tbKey;
+static pthread_once_t tbOnce = PTHREAD_ONCE_INIT;
+static _Thread_local TBuf *tbSelf = NULL;
 
+/* Returns false if it couldn't all be written */
+static bool
+writeAll(int fd, const char *data, size_t len)
+{
+    ssize_t n;
 
-#pragma mark -- Child process --
+    while (len > 0) {
+	if ((n = write(fd, data, len)) < 0) {
+	    if (errno == EINTR) continue;
+	    return false;
+	}
+	data += n;
+	len -= n;
+    }
+    return true;
+}
 
-static int
-inList(int fd, int pfds[MAX_FDS][2], int nfds)
+/* Call with tb->lock held */
+static void
+tbFlush(TBuf *tb)
 {
-    int i;
-    for (i=0; i<nfds; ++i)
-	if (pfds[i][1] == fd)
-	    return i;
-    return -1;
+    if (tb->len > 0)
+	writeAll(log_fd, tb->buf, tb->len);
+    tb->len = 0;
+}
+
+/* Milliseconds since the oldest message in tb was added */
+static long
+tbAge(TBuf *tb)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - tb->first.tv_sec) * 1000 +
+	(now.tv_nsec - tb->first.tv_nsec) / 1000000;
 }
 
 /**
- * This is the child process. Exec the command.
+ * Thread exit; write out and free the thread's buffer.
  */
 static void
-child(int fds[MAX_FDS], int pfds[MAX_FDS][2], int nfds, char **args, int argc,
-    int (*func)(int argc, char **argv))
+tbRelease(void *arg)
 {
-    int i, j;
-    int tmpfd;
-
-    /* Don't need the input halves of the pipes */
-    for (i=0; i<nfds; ++i) {
-	close(pfds[i][0]);
-    }
+    TBuf *tb = arg, **pp;
 
-    /* Dupe the output halves to the designated fds */
-    /* This is non-trivial since there might be collisions */
-    for (i=0; i<nfds; ++i) {
-	if (pfds[i][1] == fds[i]) {	/* happy coincidence */
-	    continue;
-	}
-	if ((j = inList(fds[i], pfds, nfds)) >= 0) {
-	    /* Collision */
-	    tmpfd = dup(pfds[j][1]);
-	    close(pfds[j][1]);
-	    pfds[j][1] = tmpfd;
-	}
-	if (dup2(pfds[i][1], fds[i]) < 0) {
-	    perror("dup2");
-	    _exit(3);
+    pthread_mutex_lock(&tbLock);
+    for (pp = &tbList; *pp != NULL; pp = &(*pp)->next) {
+	if (*pp == tb) {
+	    *pp = tb->next;
+	    break;
 	}
-	close(pfds[i][1]);
-	pfds[i][1] = -1;
     }
+    pthread_mutex_unlock(&tbLock);
+    tbFlush(tb);
+    pthread_mutex_destroy(&tb->lock);
+    free(tb);
+    tbSelf = NULL;
+}
 
-    if (func != NULL)
-	func(argc, args);
-    else
-	execvp(args[0], args);
+/*
+ * Around fork(), hold every lock so the child gets consistent
+ * copies. Buffers are written first so the child doesn't repeat
+ * the parent's messages, and the child forgets the other threads.
+ */
+static void
+tbPrepare()
+{
+    TBuf *tb;
+
+    pthread_mutex_lock(&tbLock);
+    for (tb = tbList; tb != NULL; tb = tb->next) {
+	pthread_mutex_lock(&tb->lock);
+	tbFlush(tb);
+    }
 }
 
+static void
+tbParent()
+{
+    TBuf *tb;
 
-#pragma mark -- Parent process --
+    for (tb = tbList; tb != NULL; tb = tb->next)
+	pthread_mutex_unlock(&tb->lock);
+    pthread_mutex_unlock(&tbLock);
+}
 
-static int signalPipe[2];
+static void
+tbChild()
+{
+    TBuf *tb, *next;
+
+    for (tb = tbList; tb != NULL; tb = next) {
+	next = tb->next;
+	pthread_mutex_unlock(&tb->lock);
+	if (tb != tbSelf) {
+	    pthread_mutex_destroy(&tb->lock);
+	    free(tb);
+	}
+    }
+    tbList = tbSelf;
+    if (tbSelf != NULL)
+	tbSelf->next = NULL;
+    tbFlusherRunning = false;
+    pthread_mutex_unlock(&tbLock);
+}
 
 static void
-sigfunc(int signal)
+tbInit()
 {
-    char val = signal & 0xff;
-    write(signalPipe[1], &val, 1);
+    pthread_key_create(&tbKey, tbRelease);
+    pthread_atfork(tbPrepare, tbParent, tbChild);
 }
 
 /**
- * After the fork, this function is called in the parent process.
- * This function watches for input on any of the fds in pfds[*][0],
- * classifies it and logs it.
- * @param ofds  list of fds the child will be writing to
- * @param ifds  list of fds the parent will be reading from.
+ * Background thread that writes out buffers that have sat too long.
  */
-void
-LogParent(int ofds[MAX_FDS], int ifds[MAX_FDS], int nfds)
+static void *
+tbFlusher(void *arg)
 {
-    LogBuffer *lb;
-    int i, j, fd;
-    fd_set readfds;
-    int maxfd;
-    int signalfd;
-    char *line;
-    NBFile *files[MAX_FDS];
-    long seq = 0;
-    bool triggered = false;
+    TBuf *tb;
 
-    fprintf(stderr, "Begin monitoring, superlog pid = %d\n", getpid());
-
-    /* Open the ifds as NBFile objects. */
-    maxfd = 0;
-    for (i=0; i<nfds; ++i)
-    {
-	fd = ifds[i];
-	if (fd > maxfd) maxfd = fd;
-	nonBlocking(fd);
-	files[i] = NBFileOpen(fd);
-    }
-
-    /* Signals we care about */
-    signal(SIGCHLD, sigfunc);
-    signal(SIGUSR1, sigfunc);
-    signal(SIGINT, sigfunc);
-    signal(SIGTERM, sigfunc);
-    pipe(signalPipe);
-    nonBlocking(signalPipe[0]);
-    nonBlocking(signalPipe[1]);
-    signalfd = signalPipe[0];
-    if (signalfd > maxfd) maxfd = signalfd;
-
-    maxfd++;
+    for (;;) {
+	int ms = superlog_flush_ms > 1 ? superlog_flush_ms / 2 : 1;
+	struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+	nanosleep(&ts, NULL);
 
-    /* And now the main loop */
-    for(;;)
-    {
-	FD_ZERO(&readfds);
-	FD_SET(signalfd, &readfds);
-	for (i=0; i<nfds; ++i) {
-	    FD_SET(ifds[i], &readfds);
-	}
-	j = select(maxfd, &readfds, NULL, NULL, NULL);
-	if (j < 0) {
-	    if (errno == EINTR)		/* Let it go, sigfunc will get it */
-		continue;
-	    perror("select");
-	    break;
-	}
-	if (FD_ISSET(signalfd, &readfds))
-	{
-	    char signum;
-	    while (read(signalfd, &signum, 1) == 1) {
-		switch (signum) {
-		  case SIGCHLD:
-		    printf("Child process has exited\n");
-		    return;
-		  case SIGUSR1:
-		    printf("Sigusr1, dumping logs\n");
-		    LogDump();
-		    break;
-		  case SIGINT:
-		  case SIGTERM:
-		    printf("Caught signal, exiting\n");
-		    return;
-		}
-	    }
-	}
-	for (i=0; i<nfds; ++i) {
-	    fd = ifds[i];
-	    if (FD_ISSET(fd, &readfds)) {
-		while ((line = NBFileRead(files[i])) != NULL) {
-		    lb = classify(line);
-		    if (verbose) {
-			printf("%s%s%s\n",
-			    colorStart(lb->type, fd), line, colorStop());
-		    }
-		    if (ExcludeTest(line)) {
-			continue;
-		    }
-		    if (triggered) {
-			continue;
-		    }
-		    if (numTrigger > 0 && TriggerCheck(line)) {
-			triggered = true;
-			fprintf(stderr, "Triggered, dumping logs\n");
-			LogDump();
-			continue;
-		    }
-		    LogBufferAppend(lb, ++seq, line, ofds[i]);
-		}
-	    }
+	pthread_mutex_lock(&tbLock);
+	for (tb = tbList; tb != NULL; tb = tb->next) {
+	    pthread_mutex_lock(&tb->lock);
+	    if (tb->len > 0 && tbAge(tb) >= superlog_flush_ms)
+		tbFlush(tb);
+	    pthread_mutex_unlock(&tb->lock);
 	}
+	pthread_mutex_unlock(&tbLock);
     }
+    return NULL;
 }
 
 /**
- * Make a file descriptor non-blocking.
+ * Return this thread's buffer, creating it on first use. Also
+ * starts the background thread, again if need be after a fork.
  */
-static void
+static TBuf *
+tbGet()
+{
+    TBuf *tb;
+    pthread_t thread;
+
+    if (tbSelf != NULL && atomic_load(&tbFlusherRunning)) return tbSelf;
+
+    pthread_once(&tbOnce, tbInit);
+    if ((tb = tbSelf) == NULL) {
+	if ((tb = calloc(1, sizeof(*tb))) == NULL)
+	    return NULL;
+	pthread_mutex_init(&tb->lock, NULL);
+	pthread_setspecific(tbKey, tb);
+	pthread_mutex_lock(&tbLock);
+	tb->next = tbList;
+	tbList = tb;
+    } else {
+	pthread_mutex_lock(&tbLock);
+    }
+    if (!tbFlusherRunning &&
+	pthread_create(&thread, NULL, tbFlusher, NULL) == 0)
+    {
+	pthread_detach(thread);
+	tbFlusherRunning = true;
+    }
+    pthread_mutex_unlock(&tbLock);
+    return tbSelf = tb;
+}
+
+/**
+ * Add a message to this thread's buffer, writing the buffer out
+ * as needed. Messages that fit in a buffer are never split.
+ */
+static void
+tbWrite(const char *data, size_t len)
+{
+    TBuf *tb = superlog_flush_ms > 0 ? tbGet() : NULL;
+
+    if (tb == NULL) {
+	writeAll(log_fd, data, len);
+	return;
+    }
+    pthread_mutex_lock(&tb->lock);
+    if (tb->len + len > sizeof(tb->buf))
+	tbFlush(tb);
+    if (len > sizeof(tb->buf)) {
+	writeAll(log_fd, data, len);
+    } else {
+	if (tb->len == 0)
+	    clock_gettime(CLOCK_MONOTONIC, &tb->first);
+	memcpy(tb->buf + tb->len, data, len);
+	tb->len += len;
+	if (tbAge(tb) >= superlog_flush_ms)
+	    tbFlush(tb);
+    }
+    pthread_mutex_unlock(&tb->lock);
+}
+
+/**
+ * Write out every thread's buffered messages.
+ */
+void
+superlogFlush()
+{
+    TBuf *tb;
+
+    pthread_mutex_lock(&tbLock);
+    for (tb = tbList; tb != NULL; tb = tb->next) {
+	pthread_mutex_lock(&tb->lock);
+	tbFlush(tb);
+	pthread_mutex_unlock(&tb->lock);
+    }
+    pthread_mutex_unlock(&tbLock);
+}
+
+
+#pragma mark -- Deferred formatting --
+
+/*
+ * superlogDeferred() sends the parent only a format key and the raw
+ * bytes of the arguments. The format string itself is sent once, the
+ * first time it's used. The parent stores the raw record and only
+ * runs printf on it when the logs are dumped.
+ *
+ * A record is the format key and the sending thread's id (4 bytes),
+ * followed by the arguments packed by type: integers, doubles and
+ * pointers as 8 bytes, long doubles in their native size, and strings
+ * as a 4-byte length followed by the characters and a nul.
+ */
+
+/**
+ * Parse the conversion that starts just after a '%'. Returns a
+ * pointer past it, or NULL for something that can't be deferred
+ * (%n, %m, wide strings, positional arguments, ...).
+ *
+ * Types: 'i' int, 'l' long, 'L' long long, 'j' intmax_t, 'z' size_t,
+ * 't' ptrdiff_t, 'd' double, 'D' long double, 's' string, 'p' pointer.
+ */
+static const char *
+fmtSpec(const char *p, FmtSpec *spec)
+{
+    char len = 0;
+
+    spec->wstar = spec->pstar = false;
+    spec->prec = -1;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) ++p;
+    if (*p == '*') {
+	spec->wstar = true;
+	++p;
+    } else {
+	while (isdigit(*p)) ++p;
+    }
+    if (*p == '.') {
+	++p;
+	if (*p == '*') {
+	    spec->pstar = true;
+	    ++p;
+	} else {
+	    spec->prec = 0;
+	    while (isdigit(*p)) spec->prec = spec->prec * 10 + *p++ - '0';
+	}
+    }
+    switch (*p) {
+      case 'h': ++p; if (*p == 'h') ++p; break;
+      case 'l': ++p; len = 'l'; if (*p == 'l') { ++p; len = 'L'; } break;
+      case 'q': case 'L': ++p; len = 'L'; break;
+      case 'j': case 'z': case 't': len = *p++; break;
+    }
+    switch (*p) {
+      case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+	spec->type = len != 0 ? len : 'i';
+	break;
+      case 'c':
+	spec->type = 'i';
+	break;
+      case 'e': case 'E': case 'f': case 'F':
+      case 'g': case 'G': case 'a': case 'A':
+	spec->type = len == 'L' ? 'D' : 'd';
+	break;
+      case 's':
+	if (len != 0) return NULL;
+	spec->type = 's';
+	break;
+      case 'p':
+	spec->type = 'p';
+	break;
+      default:
+	return NULL;
+    }
+    return p + 1;
+}
+
+/**
+ * Parse a whole format string. If specs is not NULL, fill it in.
+ * Returns the number of conversions, or -1 if the format can't be
+ * deferred.
+ */
+static int
+fmtParse(const char *fmt, FmtSpec *specs)
+{
+    FmtSpec spec;
+    int n = 0;
+
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+	if (fmt[1] == '%') {
+	    fmt += 2;
+	    continue;
+	}
+	if ((fmt = fmtSpec(fmt + 1, &spec)) == NULL)
+	    return -1;
+	if (specs != NULL)
+	    specs[n] = spec;
+	++n;
+    }
+    return n;
+}
+
+/**
+ * Register a format string for use with superlogDeferred(). Formats
+ * that can't be deferred are still accepted, and are simply formatted
+ * immediately.
+ */
+SuperlogFormat *
+superlogFormat(const char *fmt)
+{
+    SuperlogFormat *f;
+    static _Atomic uint32_t nextId = 1;
+    int n = fmtParse(fmt, NULL);
+
+    if ((f = malloc(sizeof(*f) + (n > 0 ? n : 0) * sizeof(FmtSpec))) == NULL)
+	return NULL;
+    f->fmt = fmt;
+    f->key = (uint64_t)getpid() << 32 | atomic_fetch_add(&nextId, 1);
+    atomic_init(&f->sent, false);
+    f->ok = n >= 0;
+    f->nspec = n > 0 ? n : 0;
+    if (n > 0)
+	fmtParse(fmt, f->specs);
+    return f;
+}
+
+/**
+ * Like superlog(), but formatting is deferred until superlog dumps
+ * the logs. Normally called through the SUPERLOGD() macro.
+ */
+void
+superlogDeferred(SuperlogFormat *f, ...)
+{
+    char stack[512];
+    Buf b = {stack, 0, sizeof(stack), stack};
+    int64_t ival = 0;
+    double dval;
+    long double ldval;
+    const char *str;
+    uint32_t slen, tid;
+    int i, star = -1;
+    va_list ap;
+
+    if (!superlog_enabled || f == NULL) return;
+
+    va_start(ap, f);
+    if (shmOut == NULL || !f->ok) {
+	vsuperlog(f->fmt, ap);
+	va_end(ap);
+	return;
+    }
+
+    /* First use, tell the parent about the format. If the ring
+     * won't take it now, this message is formatted here and the next
+     * one tries again.
+     */
+    if (!atomic_load_explicit(&f->sent, memory_order_acquire)) {
+	bufPut(&b, &f->key, sizeof(f->key));
+	bufPut(&b, f->fmt, strlen(f->fmt));
+	if (!shmPut(SHM_FMT, log_fd, b.buf, b.len)) {
+	    if (b.buf != b.stack) free(b.buf);
+	    vsuperlog(f->fmt, ap);
+	    va_end(ap);
+	    return;
+	}
+	atomic_store_explicit(&f->sent, true, memory_order_release);
+	b.len = 0;
+    }
+
+    tid = threadId();
+    bufPut(&b, &f->key, sizeof(f->key));
+    bufPut(&b, &tid, sizeof(tid));
+    for (i=0; i<f->nspec; ++i) {
+	FmtSpec *spec = &f->specs[i];
+	if (spec->wstar) {
+	    ival = va_arg(ap, int);
+	    bufPut(&b, &ival, sizeof(ival));
+	}
+	if (spec->pstar) {
+	    star = va_arg(ap, int);
+	    ival = star;
+	    bufPut(&b, &ival, sizeof(ival));
+	}
+	switch (spec->type) {
+	  case 'i': ival = va_arg(ap, int); break;
+	  case 'l': ival = va_arg(ap, long); break;
+	  case 'L': ival = va_arg(ap, long long); break;
+	  case 'j': ival = va_arg(ap, intmax_t); break;
+	  case 'z': ival = va_arg(ap, size_t); break;
+	  case 't': ival = va_arg(ap, ptrdiff_t); break;
+	  case 'p': ival = (intptr_t)va_arg(ap, void *); break;
+	  case 'd':
+	    dval = va_arg(ap, double);
+	    bufPut(&b, &dval, sizeof(dval));
+	    continue;
+	  case 'D':
+	    ldval = va_arg(ap, long double);
+	    bufPut(&b, &ldval, sizeof(ldval));
+	    continue;
+	  case 's':
+	    if ((str = va_arg(ap, const char *)) == NULL) str = "(null)";
+	    if (spec->pstar || spec->prec >= 0)
+		slen = strnlen(str, spec->pstar ? (star >= 0 ? star : INT_MAX)
+						: spec->prec);
+	    else
+		slen = strlen(str);
+	    bufPut(&b, &slen, sizeof(slen));
+	    bufPut(&b, str, slen);
+	    bufPut(&b, "", 1);
+	    continue;
+	}
+	bufPut(&b, &ival, sizeof(ival));
+    }
+    va_end(ap);
+    shmPut(SHM_DEFERRED, log_fd, b.buf, b.len);
+    if (b.buf != b.stack)
+	free(b.buf);
+}
+
+
+#pragma mark -- superlog --
+
+
+/* Definitions, typedefs, forward references, globals, macros */
+
+
+bool timestamps = false;
+bool showfds = false;
+bool showthreads = false;
+bool verbose = false;
+enum colorize showcolor = NONE;
+enum sevparse sevparse = SEV_PATTERNS;
+int sevcolumn = 0;
+const char *sevkey = "level";
+long readbufsize = 64*1024;
+long shmringsize = 0;
+int workers = 0;
+const char *persistdir = NULL;
+const char *ctlpath = NULL;
+long blocksize = 64*1024;
+const char *statsfile = NULL;
+int statsinterval = 10;
+long pipesize = 0;
+long maxline = 1024*1024;
+enum childexit childexit = CHILD_CONTINUE;
+long membudget = 0;
+enum stallaction stallaction = STALL_WARN;
+
+/* Messages are packed end to end in the LogBuffer arena. Each one
+ * occupies MSGSIZE(linelen) bytes, rounded up so that the next header
+ * is properly aligned.
+ */
+struct LogMsg {
+    long seq;
+    int64_t time;       /* Wall clock, ns since the epoch */
+    int linelen;
+    int tid;            /* Sending thread, or 0 if unknown */
+    short fd;
+    char type;
+    char flags;
+    unsigned char child;        /* From ChildAdd(), or 0 */
+    char line[1];
+};
+
+#define MSG_DEFERRED    0x01    /* line[] holds an unformatted message */
+#define MSG_BLOCK       0x02    /* line[] holds compressed messages */
+#define MSG_REPEAT      0x04    /* line[] holds a count of repeats of the
+				 * message before this one */
+
+/* Ends a line that was cut short, with the number of bytes cut */
+#define TRUNC_MARK      " ...[%lld bytes truncated]"
+#define TRUNC_ROOM      48      /* Enough for TRUNC_MARK and a nul */
+
+#define	MSG_ALIGN	sizeof(long)
+#define	MSGSIZE(len)	\
+	((offsetof(LogMsg, line) + (len) + 1 + MSG_ALIGN-1) & ~(MSG_ALIGN-1))
+
+/* The arena is a circular buffer of 'limit' bytes. Messages live in
+ * [head, tail) or, once the writer has wrapped around, in [head, wrap)
+ * followed by [0, tail). New messages are written at tail; the oldest
+ * are evicted from head to make room.
+ *
+ * Once the newest messages, [blockStart, tail), add up to blocksize
+ * bytes, they're compressed into a single MSG_BLOCK message in their
+ * place. So apart from that last block, the arena holds compressed
+ * data, and 'limit' bounds the compressed size.
+ *
+ * Every limit/CKPT_MAX bytes or so, a checkpoint records a message's
+ * offset, and how many messages came before it, so a query can start
+ * near the time it wants instead of at head. Checkpoints are only
+ * taken on messages that won't move: blocks once they're sealed, or
+ * every message if there's no compression. The message itself holds
+ * the time and seq to search on.
+ */
+#define CKPT_MAX        1024
+#define CKPT_SLOTS      (2*CKPT_MAX + 2)
+
+typedef struct {
+    long off;           /* Offset of the message */
+    long n;             /* Value of 'entries' before it was stored */
+} Ckpt;
+
+struct  LogBuffer {
+    long limit;		/* Size of the arena */
+    const char *pat;	/* Pattern for logs in this buffer */
+    char *arena;	/* Preallocated message storage */
+    char *spare;	/* Swapped in for arena by LogDump() */
+    struct RingHeader *ring;	/* Persistent ring file, or NULL */
+    int region;		/* Which of the ring's arenas is in use */
+    long head;		/* Offset of oldest message */
+    long tail;		/* Offset where next message will be written */
+    long wrap;		/* End of data before wrap, else limit */
+    long nmsgs;		/* Number of messages in the arena */
+    long allocated;	/* How much space consumed so far */
+    long min;		/* Share of membudget guaranteed to it */
+    int priority;	/* For keeping space beyond min; higher wins */
+    char type;
+    long blockStart;	/* Offset of first message not yet compressed */
+    long blockN;	/* Messages not yet compressed */
+    long last;		/* Offset of newest line, or -1 */
+    long repeat;	/* Offset of its MSG_REPEAT message, or -1 */
+    long entries;	/* Messages stored since init, blocks counting once */
+    Ckpt *ckpt;		/* Checkpoints, oldest at ckptFirst */
+    int ckptFirst, nckpt;
+    long ckptBytes;	/* Bytes stored since the last checkpoint */
+    int child;		/* Only for lines from this child, or 0 */
+    long classified;	/* Lines sorted into this buffer, ever */
+    long evicted;	/* Lines discarded to make room, ever */
+    long iter;		/* Iterator offset */
+    long iterLeft;	/* Messages remaining in the iteration */
+    Buf *unpack;	/* Block being iterated, decompressed */
+    long unpackPos;	/* Iterator offset within unpack */
+};
+
+
+typedef struct nbfile NBFile;
+
+/* One complete line within an NBFile buffer */
+typedef struct {
+    char *line;
+    size_t len;
+} LineSpan;
+
+/* Result of matching a line against every pattern at once */
+typedef struct {
+    int buffer;		/* Index of first matching LogBuffer */
+    int trigger;	/* Index of first matching trigger, or INT_MAX */
+    bool excluded;	/* Matched an exclusion pattern */
+} LineMatch;
+
+static LogBuffer **logbuffers = NULL;
+static int nLogBuffer = 0, maxLogBuffer = 0;
+static long budgetUsed = 0;     /* Sum of every buffer's allocated */
+
+static const char **triggers = NULL;
+static int numTrigger = 0;
+
+/* Log2 histogram: bucket[i] counts values below 2^i, and at least
+ * 2^(i-1) for i > 0.
+ */
+#define HIST_BUCKETS    40
+
+typedef struct {
+    long count;
+    int64_t sum, max;
+    long bucket[HIST_BUCKETS];
+} Hist;
+
+/* Counters kept by the parent, all in the logging thread except the
+ * dump write times, which are under dumpLock.
+ */
+typedef struct {
+    int64_t start;      /* When LogParent() began */
+    int64_t nextFile;   /* When statsfile is due to be written */
+    long lines;         /* Lines logged, excluded or not */
+    long bytes;
+    long excluded;
+    long repeats;       /* Lines collapsed into a repeat count */
+    long ignored;       /* Lines after a trigger fired */
+    long reads;         /* read() calls that returned data */
+    long moves;         /* Partial lines moved to the front by NBFileRead() */
+    long moveBytes;
+    long dumps;
+    long reclaims;      /* Times budget space was taken from a buffer */
+    long reclaimBytes;
+    long truncated;     /* Lines longer than maxline */
+    long truncBytes;    /* Bytes discarded from them */
+    long shed;          /* Lines not echoed because a pipe was near full */
+    Hist batch;         /* Lines per NBFileRead() */
+    Hist lineNs;        /* Time to log each line, averaged over a batch */
+    Hist pauseNs;       /* Time logging was held up by each dump */
+    Hist dumpNs;        /* Time to write each dump */
+} Stats;
+
+static Stats stats;
+
+/*
+ * SuperLogChildren() runs every command given to ChildAdd(), and reads
+ * the FIFOs given to ChildAdopt(), in the one parent. Every message
+ * carries the number of the child it came from, which picks its name
+ * for the output. Since seq is global, a dump merges all of them in
+ * order. By default children share the buffers, but a buffer given to
+ * LogBufferSetChild() takes that child's lines of its type instead;
+ * childMap[] says where each buffer's lines go for each child.
+ */
+#define CHILD_MAX       255     /* Must fit LogMsg.child */
+
+typedef struct {
+    const char *name;
+    char *tag;          /* "name: ", for the output */
+    char **argv;        /* Command, or NULL if adopted */
+    const char *path;   /* FIFO to read, if adopted */
+    int *fds;           /* The fds it logs on */
+    int nfds;
+    pid_t pid;          /* Running command, or 0 */
+} Child;
+
+static Child *children;
+static int nChildren, maxChildren;
+static int liveChildren;        /* Commands that haven't exited */
+static int lineChild;           /* Child the lines being logged came from */
+static int *childMap;           /* [(child-1) * nLogBuffer + buffer] */
+
+static ShmRing *shmIn = NULL;   /* Parent side of the shared memory ring */
+static int shmFd = -1;
+static int shmWakeFds[2] = {-1, -1};
+
+typedef void (*EvFunc)(int fd, void *arg);
+
+static void child(int *fds, int (*pfds)[2], int nfds,
+  char **args, int argc, int (*func)(int argc, char **argv));
+static int64_t nowNs();
+static const char *timeStr(int64_t ns);
+static void LogBufferInit(LogBuffer *lb);
+static LogBuffer * classify(const char *line, size_t len, LineMatch *m);
+static void matchLine(const char *line, size_t len, LineMatch *m);
+static bool sevMatch(const char *line, size_t len, LineMatch *m);
+static void matchInvalidate();
+static bool rxIs(const char *pat);
+static void rxReset();
+static void rxAdd(const char *pat, const LineMatch *result);
+static void rxFinish();
+static void rxMatch(const char *line, size_t len, LineMatch *m);
+static bool triggerCheckMatch(const char *match);
+static void LogBufferIterator(LogBuffer *lb);
+static LogMsg *LogBufferNext(LogBuffer *lb);
+static LogMsg * lbReserve(LogBuffer *lb, long size);
+static void lbEvict(LogBuffer *lb);
+static void lbSeal(LogBuffer *lb);
+static LogMsg *lbRepeat(LogBuffer *lb, const char *line, size_t len,
+    short fd, int tid, int flags);
+static LogMsg *lbEntryNext(LogBuffer *lb);
+static void lbCheckpoint(LogBuffer *lb, long off, long n, long size);
+static void budgetReclaim(LogBuffer *lb, long size);
+static void pagesRelease(char *ptr, long len);
+static void lbRelease(LogBuffer *lb);
+static void lbIterFrom(LogBuffer *lb, int64_t since);
+static const char * colorStart(char type, int fd, int tid);
+static const char * colorStop();
+static void nonBlocking(int fd);
+static int shmCreate(int minfd);
+static void shmDrain();
+static void shmReady(int fd, void *arg);
+static void logDeferred(const char *payload, size_t len, short fd);
+static int evAdd(int fd, EvFunc func, void *arg);
+static void evDel(int fd);
+static int evWait(int timeout);
+static int wakeOpen(int fds[2]);
+static void wakeClear(int fd);
+static int pipeStart();
+static void pipeStop();
+static void pipeLine(const char *line, size_t len, short fd);
+static void pipeSubmit();
+static void pipeFlush();
+static void matchPrepare();
+static void lbPublish(LogBuffer *lb);
+static int lbPersist(LogBuffer *lb, int idx);
+static void lbDumped(LogBuffer *lb, long seq);
+static void lbSpareClear(LogBuffer *lb);
+static void evOut(int fd, bool on);
+static int ctlListen();
+static void ctlClose();
+static void ctlTail(char type, short fd, int tid, const char *data,
+    size_t len, int flags);
+static void ctlFlush();
+static void parentFinish();
+static void drainInputs();
+static void parentRun(int *ofds, int *ifds, int *tags, int nfds);
+static LogBuffer *childBuffer(int b);
+static void childMapBuild();
+static bool childReap();
+static const char *childTag(int child);
+static void histAdd(Hist *h, int64_t v);
+static void statsReport(FILE *fp);
+static void statsText(Buf *b);
+static void statsJson(Buf *b);
+static int statsTimeout();
+static void statsTick();
+static void dumpCopy(Buf *to, const LogFilter *q);
+static void ctlCopyDone();
+static int stripTid(const char **line, size_t *len);
+static void logLine(char *line, size_t len, short fd);
+static void logRecord(const LineMatch *m, const char *data, size_t len,
+    short fd, int tid, int flags);
+static LogMsg *lbAppend(LogBuffer *lb, long seq, const char *data,
+    size_t len, short fd);
+static NBFile * NBFileOpen(int fd);
+static int NBFileRead(NBFile *file, LineSpan *spans, int max);
+static bool NBFileEof(NBFile *file);
+
+#define	NA(a)	(sizeof(a)/sizeof(a[0]))
+
+
+/**
+ * This is the usual main entry point to superlog.
+ *
+ * @param fds - array of child output file descriptors to read from
+ * @param nfds - number of file descriptors in fds
+ * @param argv - arguments (NULL-terminated) to pass to child
+ * @param func - main() function to call, or NULL
+ * @param ofilename - name of file to receive logs, or NULL for stdout
+ *
+ * If func() is not specified, this function will execute the program
+ * specified in argv[0]. If func() is specified, this function will fork
+ * and then execute func(argc, argv)
+ */
+int
+SuperLog(
+    int *fds,
+    int nfds,
+    char **argv,
+    int (*func)(int argc, char **argv),
+    const char *ofilename
+)
+{
+    int (*pfds)[2];
+    int *ifds;
+    sigset_t chld, omask;
+    int i;
+    int pid;
+    int argc;
+    char **tmp;
+
+    ofile = stdout;
+
+    if (ofilename != NULL) {
+	if ((ofile = fopen(ofilename, "w")) == NULL) {
+	    perror(ofilename);
+	    return 4;
+	}
+    }
+
+    for (argc=0, tmp=argv; *tmp != NULL; ++tmp, ++argc);
+
+    if (shmringsize > 0) {
+	int maxfd = 2;
+	for (i=0; i<nfds; ++i)
+	    if (fds[i] > maxfd) maxfd = fds[i];
+	if (shmCreate(maxfd + 1) < 0)
+	    return 3;
+    }
+
+    pfds = malloc(nfds * sizeof(*pfds));
+    ifds = malloc(nfds * sizeof(*ifds));
+    if (pfds == NULL || ifds == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	return 3;
+    }
+
+    /* Set up the pipes */
+    for (i=0; i<nfds; ++i) {
+	if (pipe(pfds[i]) < 0) {
+	    perror("pipe");
+	    return 3;
+	}
+	ifds[i] = pfds[i][0];
+	if (pipesize > 0) {
+#ifdef F_SETPIPE_SZ
+	    if (fcntl(pfds[i][1], F_SETPIPE_SZ, (int)pipesize) < 0)
+		perror("Unable to set pipe size");
+#else
+	    if (i == 0)
+		fprintf(stderr, "Pipe size can't be set on this system\n");
+#endif
+	}
+    }
+
+    /* Hold off SIGCHLD until LogParent() is ready to catch it, in
+     * case the child exits right away.
+     */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &omask);
+
+    if ((pid = fork()) < 0) {
+	perror("fork");
+	return 3;
+    }
+
+    if (pid == 0) {
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	child(fds, pfds, nfds, argv, argc, func);
+	fprintf(stderr, "exec failed\n");
+	_exit(3);
+    }
+
+    /* Parent. Close the output halves so we see EOF when the
+     * child is done with them.
+     */
+    for (i=0; i<nfds; ++i) {
+	close(pfds[i][1]);
+    }
+    if (shmIn != NULL && shmWakeFds[1] != shmWakeFds[0]) {
+	close(shmWakeFds[1]);
+    }
+    LogParent(fds, ifds, nfds);
+    parentFinish();
+    free(pfds);
+    free(ifds);
+
+    return 0;
+}
+
+/**
+ * Final dump and report, once the children are done.
+ */
+static void
+parentFinish()
+{
+    printf("Finished, dumping logs\n");
+    LogDump();
+    LogDumpWait();
+    statsReport(stderr);
+    if (statsfile != NULL) {
+	stats.nextFile = 0;
+	statsTick();
+    }
+}
+
+
+#pragma mark -- Deferred format table --
+
+/* Format key and thread id at the start of a deferred record */
+#define DEFERRED_HDR    (sizeof(uint64_t) + sizeof(uint32_t))
+
+/* Parent side: the formats the clients have registered */
+typedef struct {
+    uint64_t key;
+    SuperlogFormat *f;
+    LineMatch match;    /* Result of matching the format text */
+    int matchGen;       /* Pattern generation 'match' came from */
+} FmtDef;
+
+static FmtDef *fmtTable;        /* Open addressing hash table */
+static pthread_mutex_t fmtLock = PTHREAD_MUTEX_INITIALIZER; /* For changes */
+static size_t fmtTableSize, fmtCount;
+static int matchGen;            /* Bumped whenever the patterns change */
+
+static FmtDef *
+fmtSlot(FmtDef *table, size_t size, uint64_t key)
+{
+    size_t i = (key * 0x9E3779B97F4A7C15ULL >> 32) & (size - 1);
+    while (table[i].f != NULL && table[i].key != key)
+	i = (i + 1) & (size - 1);
+    return &table[i];
+}
+
+static FmtDef *
+fmtLookup(uint64_t key)
+{
+    FmtDef *def;
+    if (fmtTableSize == 0) return NULL;
+    def = fmtSlot(fmtTable, fmtTableSize, key);
+    return def->f != NULL ? def : NULL;
+}
+
+/**
+ * Record a format sent by a client; payload is the key followed
+ * by the format text.
+ */
+static void
+fmtDefine(const char *payload, size_t len)
+{
+    uint64_t key;
+    char *text;
+    FmtDef *def;
+    size_t i;
+
+    if (len < sizeof(key)) return;
+    memcpy(&key, payload, sizeof(key));
+    if (fmtLookup(key) != NULL) return;
+
+    if ((text = malloc(len - sizeof(key) + 1)) == NULL) return;
+    memcpy(text, payload + sizeof(key), len - sizeof(key));
+    text[len - sizeof(key)] = '\0';
+
+    pthread_mutex_lock(&fmtLock);
+    if (2 * (fmtCount + 1) > fmtTableSize) {
+	size_t size = fmtTableSize > 0 ? fmtTableSize * 2 : 64;
+	FmtDef *table = calloc(size, sizeof(*table));
+	if (table == NULL) goto done;
+	for (i=0; i<fmtTableSize; ++i)
+	    if (fmtTable[i].f != NULL)
+		*fmtSlot(table, size, fmtTable[i].key) = fmtTable[i];
+	free(fmtTable);
+	fmtTable = table;
+	fmtTableSize = size;
+    }
+
+    def = fmtSlot(fmtTable, fmtTableSize, key);
+    if ((def->f = superlogFormat(text)) == NULL)
+	goto done;
+    def->key = key;
+    def->matchGen = matchGen - 1;
+    ++fmtCount;
+    text = NULL;
+done:
+    pthread_mutex_unlock(&fmtLock);
+    free(text);
+}
+
+/**
+ * Render a deferred message into b, nul-terminated. Returns false if
+ * the format is unknown. A truncated record renders as much as it can.
+ */
+static bool
+fmtRender(const char *payload, size_t len, Buf *b)
+{
+    const char *args = payload + DEFERRED_HDR, *end = payload + len;
+    const char *fmt, *pct, *next;
+    char spec[64];
+    uint64_t key;
+    int64_t ival, stars[2];
+    double dval;
+    long double ldval;
+    uint32_t slen;
+    FmtDef *def;
+    FmtSpec *sp;
+    int i, nstar, n;
+
+    b->len = 0;
+    if (len < DEFERRED_HDR) return false;
+    memcpy(&key, payload, sizeof(key));
+    if ((def = fmtLookup(key)) == NULL) return false;
+
+/* Fetch the next packed argument, giving up if the record is short */
+#define NEXTARG(v) \
+    if (args + sizeof(v) > end) goto done; \
+    memcpy(&(v), args, sizeof(v)); \
+    args += sizeof(v)
+
+/* snprintf one conversion, with its '*' arguments if any */
+#define EMIT(v) \
+    for (;;) { \
+	char *out = b->buf + b->len; \
+	size_t room = b->size - b->len; \
+	n = nstar == 0 ? snprintf(out, room, spec, v) : \
+	    nstar == 1 ? snprintf(out, room, spec, (int)stars[0], v) : \
+	    snprintf(out, room, spec, (int)stars[0], (int)stars[1], v); \
+	if (n < 0) break; \
+	if (n < room) { b->len += n; break; } \
+	if (!bufGrow(b, n + 1)) goto done; \
+    }
+
+    fmt = def->f->fmt;
+    for (i=0, sp=def->f->specs; ; ++sp) {
+	/* Literal text up to the next conversion */
+	for (;;) {
+	    pct = strchr(fmt, '%');
+	    next = pct != NULL ? pct : fmt + strlen(fmt);
+	    bufPut(b, fmt, next - fmt);
+	    if (pct == NULL || pct[1] != '%') break;
+	    bufPut(b, "%", 1);
+	    fmt = pct + 2;
+	}
+	if (pct == NULL || i++ >= def->f->nspec) break;
+	next = fmtSpec(pct + 1, &(FmtSpec){0});
+	if (next - pct >= sizeof(spec)) break;
+	memcpy(spec, pct, next - pct);
+	spec[next - pct] = '\0';
+	fmt = next;
+
+	nstar = 0;
+	if (sp->wstar) { NEXTARG(ival); stars[nstar++] = ival; }
+	if (sp->pstar) { NEXTARG(ival); stars[nstar++] = ival; }
+	if (!bufGrow(b, 64)) goto done;
+	switch (sp->type) {
+	  case 'i': NEXTARG(ival); EMIT((int)ival); break;
+	  case 'l': NEXTARG(ival); EMIT((long)ival); break;
+	  case 'L': NEXTARG(ival); EMIT((long long)ival); break;
+	  case 'j': NEXTARG(ival); EMIT((intmax_t)ival); break;
+	  case 'z': NEXTARG(ival); EMIT((size_t)ival); break;
+	  case 't': NEXTARG(ival); EMIT((ptrdiff_t)ival); break;
+	  case 'p': NEXTARG(ival); EMIT((void *)(intptr_t)ival); break;
+	  case 'd': NEXTARG(dval); EMIT(dval); break;
+	  case 'D': NEXTARG(ldval); EMIT(ldval); break;
+	  case 's':
+	    NEXTARG(slen);
+	    if (args + slen + 1 > end) goto done;
+	    EMIT(args);
+	    args += slen + 1;
+	    break;
+	}
+    }
+#undef NEXTARG
+#undef EMIT
+
+done:
+    /* Lines are stored without their newline */
+    while (b->len > 0 && b->buf[b->len - 1] == '\n')
+	--b->len;
+    bufPut(b, "", 1);
+    --b->len;
+    return true;
+}
+
+/**
+ * Return the text of a message, rendering deferred ones into
+ * 'render'. The result is valid until render is next used.
+ */
+static const char *
+msgText(const char *line, size_t len, bool deferred, size_t *outlen,
+    Buf *render)
+{
+    bool ok;
+
+    if (!deferred) {
+	if (outlen != NULL) *outlen = len;
+	return line;
+    }
+    /* The dump thread renders while the main thread adds formats */
+    pthread_mutex_lock(&fmtLock);
+    ok = fmtRender(line, len, render);
+    pthread_mutex_unlock(&fmtLock);
+    if (!ok) {
+	bufPut(render, "(unknown deferred format)", 26);
+	--render->len;
+    }
+    if (outlen != NULL) *outlen = render->len;
+    return render->buf;
+}
+
+
+#pragma mark -- Child process --
+
+static int
+inList(int fd, int (*pfds)[2], int nfds)
+{
+    int i;
+    for (i=0; i<nfds; ++i)
+	if (pfds[i][1] == fd)
+	    return i;
+    return -1;
+}
+
+/**
+ * This is the child process. Exec the command.
+ */
+static void
+child(int *fds, int (*pfds)[2], int nfds, char **args, int argc,
+    int (*func)(int argc, char **argv))
+{
+    int i, j;
+    int tmpfd;
+
+    /* Don't need the input halves of the pipes */
+    for (i=0; i<nfds; ++i) {
+	close(pfds[i][0]);
+    }
+
+    /* Dupe the output halves to the designated fds */
+    /* This is non-trivial since there might be collisions */
+    for (i=0; i<nfds; ++i) {
+	if (pfds[i][1] == fds[i]) {	/* happy coincidence */
+	    continue;
+	}
+	if ((j = inList(fds[i], pfds, nfds)) >= 0) {
+	    /* Collision */
+	    tmpfd = dup(pfds[j][1]);
+	    close(pfds[j][1]);
+	    pfds[j][1] = tmpfd;
+	}
+	if (dup2(pfds[i][1], fds[i]) < 0) {
+	    perror("dup2");
+	    _exit(3);
+	}
+	close(pfds[i][1]);
+	pfds[i][1] = -1;
+    }
+
+    /* Tell superlogInit() where to find the shared memory ring */
+    if (shmIn != NULL) {
+	char env[40];
+	if (shmWakeFds[1] != shmWakeFds[0]) close(shmWakeFds[0]);
+	snprintf(env, sizeof(env), "%d,%d", shmFd, shmWakeFds[1]);
+	setenv(SHM_ENV, env, 1);
+    }
+
+    if (func != NULL)
+	func(argc, args);
+    else
+	execvp(args[0], args);
+}
+
+
+#pragma mark -- Multiple children --
+
+static int
+childNew(const char *name)
+{
+    Child *c;
+    size_t len = strlen(name);
+
+    if (nChildren >= CHILD_MAX) {
+	fprintf(stderr, "Too many children, %s ignored\n", name);
+	return -1;
+    }
+    if (nChildren >= maxChildren) {
+	int max = maxChildren > 0 ? maxChildren * 2 : 8;
+	Child *tmp = realloc(children, max * sizeof(*tmp));
+	if (tmp == NULL) {
+	    fprintf(stderr, "Out of memory, %s ignored\n", name);
+	    return -1;
+	}
+	children = tmp;
+	maxChildren = max;
+    }
+    c = &children[nChildren];
+    if ((c->tag = malloc(len + 3)) == NULL) {
+	fprintf(stderr, "Out of memory, %s ignored\n", name);
+	return -1;
+    }
+    memcpy(c->tag, name, len);
+    memcpy(c->tag + len, ": ", 3);
+    c->name = name;
+    c->argv = NULL;
+    c->path = NULL;
+    c->fds = NULL;
+    c->nfds = 0;
+    c->pid = 0;
+    return ++nChildren;
+}
+
+/**
+ * Add a command for SuperLogChildren() to run, collecting what it
+ * writes on fds[]. Returns the child's number, from 1, or -1.
+ */
+int
+ChildAdd(const char *name, int *fds, int nfds, char **argv)
+{
+    int n = childNew(name);
+
+    if (n < 0) return n;
+    children[n-1].argv = argv;
+    children[n-1].fds = fds;
+    children[n-1].nfds = nfds;
+    return n;
+}
+
+/**
+ * Add a process that's already running, which writes its logs to the
+ * FIFO at path. Returns the child's number, from 1, or -1.
+ */
+int
+ChildAdopt(const char *name, const char *path)
+{
+    int n = childNew(name);
+
+    if (n < 0) return n;
+    children[n-1].path = path;
+    return n;
+}
+
+/**
+ * Give this buffer to one child, before LogBufferAdd().
+ */
+void
+LogBufferSetChild(LogBuffer *lb, int child)
+{
+    lb->child = child;
+}
+
+/**
+ * The "name: " tag for a child's lines, or "" for none.
+ */
+static const char *
+childTag(int child)
+{
+    static _Thread_local char unknown[16];
+
+    if (child <= 0)
+	return "";
+    if (child <= nChildren)
+	return children[child-1].tag;
+    /* Recovered from a ring, without the names */
+    snprintf(unknown, sizeof(unknown), "#%d: ", child);
+    return unknown;
+}
+
+/**
+ * Work out, for each child and each buffer a line could be classified
+ * into, which buffer it really goes in: that child's own buffer of the
+ * same type if it has one, else a shared one.
+ */
+static void
+childMapBuild()
+{
+    int c, b, i, to;
+    bool any = false;
+
+    free(childMap);
+    childMap = NULL;
+    for (b=0; b<nLogBuffer; ++b)
+	if (logbuffers[b]->child != 0)
+	    any = true;
+    if (!any || nChildren == 0)
+	return;
+    childMap = malloc(nChildren * nLogBuffer * sizeof(*childMap));
+    if (childMap == NULL) {
+	fprintf(stderr, "Out of memory, children share all buffers\n");
+	return;
+    }
+    for (c=1; c<=nChildren; ++c) {
+	for (b=0; b<nLogBuffer; ++b) {
+	    char type = logbuffers[b]->type;
+	    to = -1;
+	    for (i=0; i<nLogBuffer && to < 0; ++i)
+		if (logbuffers[i]->child == c && logbuffers[i]->type == type)
+		    to = i;
+	    if (to < 0 && (logbuffers[b]->child == 0 || logbuffers[b]->child == c))
+		to = b;
+	    for (i=0; i<nLogBuffer && to < 0; ++i)
+		if (logbuffers[i]->child == 0 && logbuffers[i]->type == type)
+		    to = i;
+	    childMap[(c-1) * nLogBuffer + b] = to >= 0 ? to : b;
+	}
+    }
+}
+
+/**
+ * The buffer for a line classified into buffer b, from lineChild.
+ */
+static LogBuffer *
+childBuffer(int b)
+{
+    if (lineChild > 0 && childMap != NULL)
+	b = childMap[(lineChild - 1) * nLogBuffer + b];
+    return logbuffers[b];
+}
+
+/**
+ * Collect the children that have exited, and act on childexit.
+ * Returns true once there's no reason to carry on.
+ */
+static bool
+childReap()
+{
+    bool stop = false;
+    int status, i;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	for (i=0; i<nChildren && children[i].pid != pid; ++i);
+	if (i >= nChildren)
+	    continue;
+	children[i].pid = 0;
+	--liveChildren;
+	if (WIFEXITED(status))
+	    printf("Child %s has exited, status %d\n", children[i].name,
+		WEXITSTATUS(status));
+	else
+	    printf("Child %s was killed by signal %d\n", children[i].name,
+		WTERMSIG(status));
+	drainInputs();
+	if (childexit == CHILD_STOP)
+	    stop = true;
+	else if (childexit == CHILD_DUMP && liveChildren > 0)
+	    LogDump();
+    }
+    if (stop) {
+	for (i=0; i<nChildren; ++i)
+	    if (children[i].pid > 0)
+		kill(children[i].pid, SIGTERM);
+    }
+    return stop || liveChildren == 0;
+}
+
+/**
+ * Like SuperLog(), for all the children given to ChildAdd() and
+ * ChildAdopt(). Returns when every command has exited, or the first
+ * has if childexit is CHILD_STOP, or on SIGINT or SIGTERM.
+ */
+int
+SuperLogChildren(const char *ofilename)
+{
+    int *ofds, *ifds, *tags;
+    int i, j, n = 0, total = 0;
+    sigset_t chld, omask;
+
+    if (nChildren == 0) {
+	fprintf(stderr, "No children to run\n");
+	return 2;
+    }
+    ofile = stdout;
+    if (ofilename != NULL) {
+	if ((ofile = fopen(ofilename, "w")) == NULL) {
+	    perror(ofilename);
+	    return 4;
+	}
+    }
+    if (shmringsize > 0) {
+	fprintf(stderr, "No shared memory ring with several children\n");
+	shmringsize = 0;
+    }
+
+    for (i=0; i<nChildren; ++i)
+	total += children[i].argv != NULL ? children[i].nfds : 1;
+    ofds = malloc(total * sizeof(*ofds));
+    ifds = malloc(total * sizeof(*ifds));
+    tags = malloc(total * sizeof(*tags));
+    if (ofds == NULL || ifds == NULL || tags == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	free(ofds);
+	free(ifds);
+	free(tags);
+	return 3;
+    }
+
+    /* As in SuperLog(), hold off SIGCHLD until LogParent() is ready */
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &omask);
+
+    for (i=0; i<nChildren; ++i)
+    {
+	Child *c = &children[i];
+	int (*pfds)[2];
+	int argc;
+
+	if (c->argv == NULL) {
+	    /* Opened for writing too, so it doesn't see EOF whenever
+	     * the writer closes it, and kept from the other children.
+	     */
+	    if ((ifds[n] = open(c->path, O_RDWR|O_CLOEXEC)) < 0) {
+		perror(c->path);
+		goto fail;
+	    }
+	    ofds[n] = ifds[n];
+	    tags[n++] = i + 1;
+	    continue;
+	}
+
+	if ((pfds = malloc(c->nfds * sizeof(*pfds))) == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    goto fail;
+	}
+	for (j=0; j<c->nfds; ++j) {
+	    if (pipe(pfds[j]) < 0) {
+		perror("pipe");
+		while (--j >= 0)
+		    close(pfds[j][1]);
+		free(pfds);
+		goto fail;
+	    }
+	    /* Keep the other children from inheriting this one's pipes */
+	    fcntl(pfds[j][0], F_SETFD, FD_CLOEXEC);
+#ifdef F_SETPIPE_SZ
+	    if (pipesize > 0 && fcntl(pfds[j][1], F_SETPIPE_SZ, (int)pipesize) < 0)
+		perror("Unable to set pipe size");
+#endif
+	    ofds[n] = c->fds[j];
+	    ifds[n] = pfds[j][0];
+	    tags[n++] = i + 1;
+	}
+	for (argc=0; c->argv[argc] != NULL; ++argc);
+	if ((c->pid = fork()) < 0) {
+	    perror("fork");
+	    for (j=0; j<c->nfds; ++j)
+		close(pfds[j][1]);
+	    free(pfds);
+	    goto fail;
+	}
+	if (c->pid == 0) {
+	    sigprocmask(SIG_SETMASK, &omask, NULL);
+	    child(c->fds, pfds, c->nfds, c->argv, argc, NULL);
+	    fprintf(stderr, "exec failed\n");
+	    _exit(3);
+	}
+	for (j=0; j<c->nfds; ++j)
+	    close(pfds[j][1]);
+	free(pfds);
+	++liveChildren;
+    }
+
+    parentRun(ofds, ifds, tags, n);
+    parentFinish();
+    free(ofds);
+    free(ifds);
+    free(tags);
+    return 0;
+
+fail:
+    /* Children already started carry on; we stop reading them */
+    while (--n >= 0)
+	close(ifds[n]);
+    free(ofds);
+    free(ifds);
+    free(tags);
+    sigprocmask(SIG_SETMASK, &omask, NULL);
+    return 3;
+}
+
+
+#pragma mark -- Parent process --
+
+/* One fd being read from the child */
+typedef struct {
+    NBFile *file;
+    int fd;             /* The fd we read from */
+    short ofd;          /* The fd as the child knows it */
+    int child;          /* Which child, or 0 if there's just one */
+    int capacity;       /* Size of the pipe */
+    int highWater;      /* Most bytes seen waiting in it */
+    long nearFull;      /* Times it was seen near full */
+    int64_t nearSince;  /* When it was first seen near full, or 0 */
+    int64_t nearNs;     /* Total time seen near full */
+} Input;
+
+/*
+ * A pipe that's three quarters full means the child is about to block
+ * writing its logs, which is the one thing superlog mustn't make it
+ * do. Each input's fill level is sampled with FIONREAD when it becomes
+ * readable and after each batch of lines, which costs a system call
+ * per batch. The time between seeing it near full and seeing it drain
+ * is a lower bound on how long the child was close to stalling.
+ */
+#define PIPE_DEFAULT    65536   /* Pipe size, if we can't ask */
+#define PIPE_NEAR(cap)  ((cap) - (cap)/4)
+
+static int signalPipe[2];
+static Input *inputs;
+static int nInputs;
+static bool done;
+static long seq = 0;
+static bool triggered = false;
+static int nearInputs = 0;      /* Inputs near full, see pipeSample() */
+static int64_t stallWarned;     /* When we last warned about it */
+static int ctlTailing = 0;      /* Control socket tail subscribers */
+static int ctlSending = 0;      /* Control socket clients being sent copies */
+static int64_t lineTime;        /* Timestamp for lines being logged */
+
+static void
+sigfunc(int signal)
+{
+    char val = signal & 0xff;
+    write(signalPipe[1], &val, 1);
+}
+
+/**
+ * Check how full this input's pipe is, and warn if it's near full.
+ */
+static void
+pipeSample(Input *in)
+{
+    int fill;
+    int64_t now;
+
+    if (ioctl(in->fd, FIONREAD, &fill) < 0)
+	return;
+    if (fill > in->highWater)
+	in->highWater = fill;
+    if (fill >= PIPE_NEAR(in->capacity)) {
+	if (in->nearSince != 0)
+	    return;
+	in->nearSince = now = nowNs();
+	++in->nearFull;
+	++nearInputs;
+	if (stallaction != STALL_IGNORE && now - stallWarned >= 1000000000) {
+	    stallWarned = now;
+	    fprintf(stderr, "Pipe for fd %d is %d%% full, child may block%s\n",
+		in->ofd, (int)(fill * 100LL / in->capacity),
+		stallaction == STALL_SHED && verbose ? ", not echoing" : "");
+	}
+    } else if (in->nearSince != 0) {
+	in->nearNs += nowNs() - in->nearSince;
+	in->nearSince = 0;
+	--nearInputs;
+    }
+}
+
+/**
+ * Read everything available on this input and log it.
+ */
+static void
+inputReady(int fd, void *arg)
+{
+    Input *in = arg;
+    LineSpan spans[256];
+    int64_t elapsed;
+    int k, n;
+
+    lineChild = in->child;
+    pipeSample(in);
+    while ((n = NBFileRead(in->file, spans, NA(spans))) > 0) {
+	/* One timestamp per read is plenty */
+	lineTime = nowNs();
+	for (k=0; k<n; ++k) {
+	    if (workers > 0)
+		pipeLine(spans[k].line, spans[k].len, in->ofd);
+	    else
+		logLine(spans[k].line, spans[k].len, in->ofd);
+	}
+	elapsed = nowNs() - lineTime;
+	histAdd(&stats.batch, n);
+	histAdd(&stats.lineNs, elapsed / n);
+	pipeSample(in);
+    }
+    if (workers > 0)
+	pipeSubmit();
+    if (NBFileEof(in->file)) {
+	evDel(fd);
+    }
+}
+
+/**
+ * Pick up whatever the child left in the pipes.
+ */
+static void
+drainInputs()
+{
+    int i;
+    for (i=0; i<nInputs; ++i)
+	if (!NBFileEof(inputs[i].file))
+	    inputReady(inputs[i].fd, &inputs[i]);
+    if (workers > 0)
+	pipeFlush();
+    if (shmIn != NULL)
+	shmDrain();
+}
+
+static void
+signalReady(int fd, void *arg)
+{
+    char signum;
+    while (read(fd, &signum, 1) == 1) {
+	switch (signum) {
+	  case SIGCHLD:
+	    if (nChildren > 0) {
+		if (childReap()) {
+		    done = true;
+		    return;
+		}
+		break;
+	    }
+	    printf("Child process has exited\n");
+	    drainInputs();
+	    done = true;
+	    return;
+	  case SIGUSR1:
+	    printf("Sigusr1, dumping logs\n");
+	    drainInputs();
+	    LogDump();
+	    break;
+	  case SIGUSR2:
+	    statsReport(stderr);
+	    break;
+	  case SIGINT:
+	  case SIGTERM:
+	    printf("Caught signal, exiting\n");
+	    done = true;
+	    return;
+	}
+    }
+}
+
+/**
+ * After the fork, this function is called in the parent process.
+ * This function watches for input on any of the fds in ifds[],
+ * classifies it and logs it.
+ * @param ofds  list of fds the child will be writing to
+ * @param ifds  list of fds the parent will be reading from.
+ * @param nfds  length of ofds[] and ifds[]
+ */
+void
+LogParent(int *ofds, int *ifds, int nfds)
+{
+    parentRun(ofds, ifds, NULL, nfds);
+}
+
+/**
+ * LogParent(), with the child number for each of ifds[] in tags[],
+ * or NULL if there's only the one child.
+ */
+static void
+parentRun(int *ofds, int *ifds, int *tags, int nfds)
+{
+    sigset_t chld;
+    int i;
+
+    fprintf(stderr, "Begin monitoring, superlog pid = %d\n", getpid());
+    stats.start = nowNs();
+
+    /* Open the ifds as NBFile objects. */
+    if ((inputs = malloc(nfds * sizeof(*inputs))) == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	return;
+    }
+    for (nInputs=0; nInputs<nfds; ++nInputs)
+    {
+	Input *in = &inputs[nInputs];
+	nonBlocking(ifds[nInputs]);
+	if ((in->file = NBFileOpen(ifds[nInputs])) == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    return;
+	}
+	in->fd = ifds[nInputs];
+	in->ofd = ofds[nInputs];
+	in->child = tags != NULL ? tags[nInputs] : 0;
+	in->capacity = 0;
+#ifdef F_GETPIPE_SZ
+	in->capacity = fcntl(in->fd, F_GETPIPE_SZ);
+#endif
+	if (in->capacity <= 0)
+	    in->capacity = PIPE_DEFAULT;
+	in->highWater = 0;
+	in->nearFull = 0;
+	in->nearSince = in->nearNs = 0;
+	if (evAdd(ifds[nInputs], inputReady, in) < 0) {
+	    return;
+	}
+    }
+
+    /* Signals we care about */
+    signal(SIGCHLD, sigfunc);
+    signal(SIGUSR1, sigfunc);
+    signal(SIGUSR2, sigfunc);
+    signal(SIGINT, sigfunc);
+    signal(SIGTERM, sigfunc);
+    pipe(signalPipe);
+    nonBlocking(signalPipe[0]);
+    nonBlocking(signalPipe[1]);
+    if (evAdd(signalPipe[0], signalReady, NULL) < 0) {
+	return;
+    }
+    if (shmIn != NULL) {
+	nonBlocking(shmWakeFds[0]);
+	if (evAdd(shmWakeFds[0], shmReady, NULL) < 0) {
+	    return;
+	}
+    }
+    if (workers > 0 && pipeStart() < 0) {
+	fprintf(stderr, "Unable to start worker threads, continuing without\n");
+	workers = 0;
+    }
+    if (ctlpath != NULL && ctlListen() < 0) {
+	fprintf(stderr, "Unable to open control socket, continuing without\n");
+    }
+    childMapBuild();
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &chld, NULL);
+
+    /* And now the main loop */
+    for (done = false; !done; )
+    {
+	if (evWait(statsTimeout()) < 0) {
+	    break;
+	}
+	if (ctlTailing > 0 || ctlSending > 0)
+	    ctlFlush();
+	if (statsfile != NULL)
+	    statsTick();
+    }
+
+    if (workers > 0)
+	pipeStop();
+    for (i=0; i<nInputs; ++i)
+	evDel(inputs[i].fd);
+    evDel(signalPipe[0]);
+    ctlClose();
+    if (shmIn != NULL) {
+	uint64_t dropped = atomic_load(&shmIn->dropped);
+	evDel(shmWakeFds[0]);
+	if (dropped > 0)
+	    fprintf(stderr, "%llu messages dropped, shared memory ring full\n",
+		(unsigned long long)dropped);
+    }
+}
+
+/**
+ * Create the shared memory ring and its wakeup fd. The fds are moved
+ * to 'minfd' or above so they won't collide with the fds the child
+ * is going to log on. Returns 0 on success, -1 on error.
+ */
+static int
+shmCreate(int minfd)
+{
+    size_t size = (shmringsize + SHM_ALIGN-1) & ~(SHM_ALIGN-1);
+    int fd, tmp;
+
+#ifdef LINUX
+    fd = memfd_create("superlog", 0);
+#else
+    {
+	char name[40];
+	snprintf(name, sizeof(name), "/superlog.%d", getpid());
+	if ((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) >= 0)
+	    shm_unlink(name);
+    }
+#endif
+    if (fd < 0) {
+	perror("shared memory");
+	return -1;
+    }
+    if (ftruncate(fd, sizeof(ShmRing) + size) < 0) {
+	perror("ftruncate");
+	close(fd);
+	return -1;
+    }
+    shmIn = mmap(NULL, sizeof(ShmRing) + size, PROT_READ|PROT_WRITE,
+		MAP_SHARED, fd, 0);
+    if (shmIn == MAP_FAILED) {
+	perror("mmap");
+	shmIn = NULL;
+	close(fd);
+	return -1;
+    }
+
+    if (wakeOpen(shmWakeFds) < 0)
+	return -1;
+
+    /* Keep the fds out of the way of the child's logging fds */
+    shmFd = fcntl(fd, F_DUPFD, minfd);
+    close(fd);
+    tmp = fcntl(shmWakeFds[0], F_DUPFD, minfd);
+    close(shmWakeFds[0]);
+    if (shmWakeFds[1] == shmWakeFds[0]) {
+	shmWakeFds[0] = shmWakeFds[1] = tmp;
+    } else {
+	shmWakeFds[0] = tmp;
+	tmp = fcntl(shmWakeFds[1], F_DUPFD, minfd);
+	close(shmWakeFds[1]);
+	shmWakeFds[1] = tmp;
+    }
+
+    /* Positions start one lap in, so that the zeroed stamps in the
+     * fresh ring can't be mistaken for published records.
+     */
+    shmIn->magic = SHM_MAGIC;
+    shmIn->size = size;
+    atomic_store(&shmIn->dropped, 0);
+    atomic_store(&shmIn->reserve, size);
+    atomic_store(&shmIn->tail, size);
+    return 0;
+}
+
+/**
+ * Log every line of every published record in the ring.
+ */
+static void
+shmDrain()
+{
+    ShmRing *ring = shmIn;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    lineTime = nowNs();
+    lineChild = 0;
+
+    for (;;) {
+	ShmRec *rec = (ShmRec *)(ring->data + tail % ring->size);
+	char *ptr, *end, *nl;
+
+	/* Pairs with the fence in shmPut() so that a client either
+	 * sees our tail or we see its stamp.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&rec->stamp, memory_order_acquire) != tail)
+	    break;
+	ptr = (char *)(rec + 1);
+	switch (rec->kind) {
+	  case SHM_TEXT:
+	    end = ptr + rec->len;
+	    while (ptr < end) {
+		if ((nl = memchr(ptr, '\n', end - ptr)) == NULL) nl = end;
+		logLine(ptr, nl - ptr, rec->fd);
+		ptr = nl + 1;
+	    }
+	    break;
+	  case SHM_FMT:
+	    fmtDefine(ptr, rec->len);
+	    break;
+	  case SHM_DEFERRED:
+	    logDeferred(ptr, rec->len, rec->fd);
+	    break;
+	}
+	tail += SHM_SIZE(rec->len);
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+}
+
+/**
+ * Log a deferred message. It's classified, filtered and checked for
+ * triggers using the text of its format string, not the final text.
+ */
+static void
+logDeferred(const char *payload, size_t len, short fd)
+{
+    uint64_t key;
+    uint32_t tid;
+    FmtDef *def;
+    LineMatch m;
+
+    if (len >= DEFERRED_HDR) {
+	memcpy(&key, payload, sizeof(key));
+	memcpy(&tid, payload + sizeof(key), sizeof(tid));
+    }
+    if (len < DEFERRED_HDR || (def = fmtLookup(key)) == NULL) {
+	const char *unknown = "(unknown deferred format)";
+	logLine((char *)unknown, strlen(unknown), fd);
+	return;
+    }
+    if (def->matchGen != matchGen) {
+	classify(def->f->fmt, strlen(def->f->fmt), &def->match);
+	def->matchGen = matchGen;
+    }
+    m = def->match;
+    logRecord(&m, payload, len, fd, tid, MSG_DEFERRED);
+}
+
+static void
+shmReady(int fd, void *arg)
+{
+    wakeClear(fd);
+    /* Pipe lines read before these are still in the workers' batches,
+     * and have to be numbered first.
+     */
+    if (workers > 0)
+	pipeFlush();
+    shmDrain();
+}
+
+/**
+ * Process one line from the child: classify it, echo it if
+ * verbose, filter it and store it.
+ */
+static void
+logLine(char *line, size_t len, short fd)
+{
+    LineMatch m;
+    const char *text = line;
+    int tid = stripTid(&text, &len);
+
+    classify(text, len, &m);
+    logRecord(&m, text, len, fd, tid, 0);
+}
+
+/**
+ * Strip the thread id tag that superlog() puts at the start of each
+ * line. Returns the thread id, or 0 if there was no tag.
+ */
+static int
+stripTid(const char **line, size_t *len)
+{
+    const char *ptr = *line, *end = *line + *len;
+    long tid = 0;
+
+    if (*len <= 2 || ptr[0] != TID_START || !isdigit(ptr[1]))
+	return 0;
+    for (++ptr; ptr < end && isdigit(*ptr); ++ptr)
+	tid = tid * 10 + *ptr - '0';
+    if (ptr >= end || *ptr != TID_END)
+	return 0;
+    *len -= ptr + 1 - *line;
+    *line = ptr + 1;
+    return tid;
+}
+
+/**
+ * Process one record that has already been matched against the
+ * patterns.
+ */
+static void
+logRecord(const LineMatch *m, const char *data, size_t len, short fd,
+    int tid, int flags)
+{
+    LogBuffer *lb = childBuffer(m->buffer);
+    LogMsg *msg;
+
+    ++stats.lines;
+    stats.bytes += len;
+    ++lb->classified;
+    if (verbose && nearInputs > 0 && stallaction == STALL_SHED) {
+	++stats.shed;
+    } else if (verbose) {
+	static Buf render;
+	size_t tlen;
+	const char *text = msgText(data, len, flags & MSG_DEFERRED, &tlen,
+				   &render);
+	fputs(colorStart(lb->type, fd, tid), stdout);
+	if (lineChild > 0) fputs(childTag(lineChild), stdout);
+	fwrite(text, 1, tlen, stdout);
+	fputs(colorStop(), stdout);
+	putchar('\n');
+    }
+    if (m->excluded) {
+	++stats.excluded;
+	return;
+    }
+    if (triggered) {
+	++stats.ignored;
+	return;
+    }
+    if (numTrigger > 0 && triggerCheckMatch(
+	    m->trigger < numTrigger ? triggers[m->trigger] : NULL))
+    {
+	triggered = true;
+	fprintf(stderr, "Triggered, dumping logs\n");
+	LogDump();
+	return;
+    }
+    if ((msg = lbRepeat(lb, data, len, fd, tid, flags)) != NULL) {
+	/* It's always the newest in its buffer, so it takes the seq of
+	 * the latest repeat, and sorts after lines logged since the
+	 * first one.
+	 */
+	++stats.repeats;
+	msg->seq = ++seq;
+	msg->time = lineTime;
+    } else {
+	msg = lbAppend(lb, ++seq, data, len, fd);
+	msg->time = lineTime;
+	msg->tid = tid;
+	msg->flags = flags;
+	msg->child = lineChild;
+    }
+    if (lb->ring != NULL) lbPublish(lb);
+    if (ctlTailing > 0)
+	ctlTail(lb->type, fd, tid, data, len, flags);
+}
+
+/**
+ * Make a file descriptor non-blocking.
+ */
+static void
 nonBlocking(int fd)
 {
-    int flags;
-    flags = fcntl(fd, F_GETFL);
-    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int flags;
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Current wall clock time in ns.
+ */
+static int64_t
+nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Format a timestamp as "YYYY-MM-DD HH:MM:SS.uuuuuu ". The date
+ * and time part is cached, since consecutive messages are usually
+ * in the same second.
+ */
+static const char *
+timeStr(int64_t ns)
+{
+    /* The dump thread formats times too */
+    static _Thread_local char buffer[40];
+    static _Thread_local time_t cached = -1;
+    static _Thread_local int len;
+    time_t t = ns / 1000000000;
+    long us = ns % 1000000000 / 1000;
+    char *ptr;
+    int i;
+
+    if (t != cached) {
+	struct tm *tm = localtime(&t);
+	len = strftime(buffer, sizeof(buffer), "%F %T.", tm);
+	cached = t;
+    }
+    ptr = buffer + len;
+    for (i=5; i>=0; --i, us /= 10)
+	ptr[i] = '0' + us % 10;
+    ptr[6] = ' ';
+    ptr[7] = '\0';
+    return buffer;
+}
+
+
+
+#pragma mark -- Event loop --
+
+/*
+ * A minimal event loop. On Linux it's edge-triggered epoll, so the
+ * cost of a wakeup is proportional to the number of ready fds, not
+ * the number being watched. Elsewhere it falls back to poll(). Either
+ * way, a handler must consume everything available on its fd before
+ * returning.
+ */
+
+typedef struct {
+    int fd;             /* -1 once removed */
+    EvFunc func;
+    void *arg;
+    bool in, out;       /* Watching for input, room for output */
+} EvSource;
+
+static EvSource **evSources;
+static int evN, evMax;
+static bool evDirty;            /* Sources were removed */
+
+#ifdef LINUX
+static int epfd = -1;
+#else
+static struct pollfd *evPoll;
+#endif
+
+/**
+ * Call func(fd, arg) whenever fd has input. Returns 0 on success,
+ * -1 on error.
+ */
+static int
+evAdd(int fd, EvFunc func, void *arg)
+{
+    EvSource *src;
+
+    if (evN >= evMax) {
+	int max = evMax > 0 ? evMax * 2 : 16;
+	EvSource **tmp = realloc(evSources, max * sizeof(*tmp));
+	if (tmp == NULL) goto oom;
+	evSources = tmp;
+#ifndef LINUX
+	{
+	    struct pollfd *ptmp = realloc(evPoll, max * sizeof(*ptmp));
+	    if (ptmp == NULL) goto oom;
+	    evPoll = ptmp;
+	}
+#endif
+	evMax = max;
+    }
+    if ((src = malloc(sizeof(*src))) == NULL) goto oom;
+    src->fd = fd;
+    src->func = func;
+    src->arg = arg;
+    src->in = true;
+    src->out = false;
+
+#ifdef LINUX
+    {
+	struct epoll_event ev;
+	if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	    perror("epoll_create1");
+	    free(src);
+	    return -1;
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = src;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	    perror("epoll_ctl");
+	    free(src);
+	    return -1;
+	}
+    }
+#else
+    evPoll[evN].fd = fd;
+    evPoll[evN].events = POLLIN;
+    evPoll[evN].revents = 0;
+#endif
+    evSources[evN++] = src;
+    return 0;
+
+oom:
+    fprintf(stderr, "Out of memory\n");
+    return -1;
+}
+
+/**
+ * Stop watching this fd. Safe to call from within a handler.
+ */
+static void
+evDel(int fd)
+{
+    int i;
+    for (i=0; i<evN; ++i) {
+	if (evSources[i]->fd == fd) {
+#ifdef LINUX
+	    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	    evSources[i]->fd = -1;
+	    evDirty = true;
+	    return;
+	}
+    }
+}
+
+/**
+ * Watch for what evSources[i] asks for. A hangup or error is
+ * reported whatever that is.
+ */
+static void
+evMod(int i)
+{
+    EvSource *src = evSources[i];
+#ifdef LINUX
+    struct epoll_event ev;
+    ev.events = EPOLLET | (src->in ? EPOLLIN : 0) |
+	(src->out ? EPOLLOUT : 0);
+    ev.data.ptr = src;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev);
+#else
+    evPoll[i].events = (src->in ? POLLIN : 0) | (src->out ? POLLOUT : 0);
+#endif
+}
+
+/**
+ * Stop calling the handler for input on this fd, or start again.
+ * Once there's no more to come, poll() would otherwise keep saying
+ * there is.
+ */
+static void
+evIn(int fd, bool on)
+{
+    int i;
+    for (i=0; i<evN; ++i) {
+	if (evSources[i]->fd == fd) {
+	    evSources[i]->in = on;
+	    evMod(i);
+	    return;
+	}
+    }
+}
+
+/**
+ * Also call the handler for this fd when it becomes writable, or
+ * stop doing so. The handler has to check which it is.
+ */
+static void
+evOut(int fd, bool on)
+{
+    int i;
+    for (i=0; i<evN; ++i) {
+	if (evSources[i]->fd == fd) {
+	    evSources[i]->out = on;
+	    evMod(i);
+	    return;
+	}
+    }
+}
+
+/**
+ * Free sources removed by evDel(). Done after dispatch so that
+ * pending events never refer to freed memory.
+ */
+static void
+evReap()
+{
+    int i, j;
+    for (i=j=0; i<evN; ++i) {
+	if (evSources[i]->fd < 0) {
+	    free(evSources[i]);
+	    continue;
+	}
+#ifndef LINUX
+	evPoll[j] = evPoll[i];
+#endif
+	evSources[j++] = evSources[i];
+    }
+    evN = j;
+    evDirty = false;
+}
+
+/**
+ * Wait up to 'timeout' ms (-1 for forever) for input, and call the
+ * handlers for all ready fds. Returns the number of ready fds, or
+ * -1 on error.
+ */
+static int
+evWait(int timeout)
+{
+    int i, n;
+#ifdef LINUX
+    struct epoll_event events[64];
+
+    n = epoll_wait(epfd, events, NA(events), timeout);
+    if (n < 0) {
+	if (errno == EINTR)     /* Let it go, sigfunc will get it */
+	    return 0;
+	perror("epoll_wait");
+	return -1;
+    }
+    for (i=0; i<n; ++i) {
+	EvSource *src = events[i].data.ptr;
+	if (src->fd >= 0)
+	    src->func(src->fd, src->arg);
+    }
+#else
+    int nsrc = evN;
+
+    n = poll(evPoll, nsrc, timeout);
+    if (n < 0) {
+	if (errno == EINTR)     /* Let it go, sigfunc will get it */
+	    return 0;
+	perror("poll");
+	return -1;
+    }
+    for (i=0; i<nsrc; ++i) {
+	EvSource *src = evSources[i];
+	if (evPoll[i].revents != 0 && src->fd >= 0)
+	    src->func(src->fd, src->arg);
+    }
+#endif
+    if (evDirty) evReap();
+    return n;
+}
+
+/**
+ * Create an fd pair for waking up the event loop: an eventfd on
+ * Linux, a pipe elsewhere. fds[1] is for writing, fds[0] for reading.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+wakeOpen(int fds[2])
+{
+#ifdef LINUX
+    fds[0] = fds[1] = eventfd(0, 0);
+    if (fds[0] < 0) {
+	perror("eventfd");
+	return -1;
+    }
+#else
+    if (pipe(fds) < 0) {
+	perror("pipe");
+	return -1;
+    }
+    nonBlocking(fds[1]);
+#endif
+    return 0;
+}
+
+/**
+ * Consume pending wakeups on an fd from wakeOpen().
+ */
+static void
+wakeClear(int fd)
+{
+#ifdef LINUX
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+#else
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+#endif
+}
+
+
+
+#pragma mark -- Worker pipeline --
+
+/*
+ * With workers > 0, matching lines against the patterns is done on
+ * worker threads. The event loop reads lines as usual and packs them
+ * into batches, which are handed to the workers round robin through
+ * single-producer single-consumer rings. A worker classifies each
+ * batch and passes it back on a second ring. The main thread commits
+ * batches in the order it handed them out, so lines keep their order,
+ * and assigns sequence numbers as it goes, so seq remains a total
+ * order over everything logged.
+ */
+
+#define BATCH_LINES     256
+#define BATCH_QLEN      8       /* Batches in flight per worker */
+
+typedef struct {
+    uint32_t off, len;  /* Line within text[] */
+    short fd;
+    int tid;
+    LineMatch m;
+} BatchLine;
+
+typedef struct Batch {
+    struct Batch *next; /* On the free list */
+    int64_t time;       /* When the lines were read */
+    int child;          /* Which child they came from */
+    int n;
+    size_t used;        /* Bytes of text[] in use */
+    BatchLine lines[BATCH_LINES];
+    char text[];
+} Batch;
+
+typedef struct {
+    _Atomic size_t head;        /* Written only by the producer */
+    char pad1[56];
+    _Atomic size_t tail;        /* Written only by the consumer */
+    char pad2[56];
+    Batch *slots[BATCH_QLEN];
+} BatchRing;
+
+typedef struct {
+    pthread_t thread;
+    BatchRing in, out;
+    int inflight;               /* Handed out and not yet committed */
+    pthread_mutex_t lock;       /* For sleeping when idle */
+    pthread_cond_t cond;
+    _Atomic bool sleeping;
+} Worker;
+
+static Worker *pool;
+static int nextSubmit, nextCommit, inflight;
+static Batch *batch;            /* Being filled */
+static Batch *batchFree;
+static size_t batchSize;        /* Size of text[] */
+static _Atomic bool pipeStopping;
+static _Atomic bool pipeWakePending;
+static int pipeWakeFds[2] = {-1, -1};
+
+static bool
+ringPush(BatchRing *r, Batch *b)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire)
+	>= BATCH_QLEN)
+    {
+	return false;
+    }
+    r->slots[head % BATCH_QLEN] = b;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
+
+static Batch *
+ringPop(BatchRing *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    Batch *b;
+
+    if (atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+	return NULL;
+    b = r->slots[tail % BATCH_QLEN];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return b;
+}
+
+static void *
+workerMain(void *arg)
+{
+    Worker *w = arg;
+    Batch *b;
+    int i;
+
+    for (;;) {
+	if ((b = ringPop(&w->in)) == NULL) {
+	    pthread_mutex_lock(&w->lock);
+	    atomic_store(&w->sleeping, true);
+	    while ((b = ringPop(&w->in)) == NULL &&
+		   !atomic_load(&pipeStopping))
+	    {
+		pthread_cond_wait(&w->cond, &w->lock);
+	    }
+	    atomic_store(&w->sleeping, false);
+	    pthread_mutex_unlock(&w->lock);
+	    if (b == NULL)
+		return NULL;
+	}
+
+	for (i=0; i<b->n; ++i) {
+	    BatchLine *bl = &b->lines[i];
+	    const char *line = b->text + bl->off;
+	    size_t len = bl->len;
+	    bl->tid = stripTid(&line, &len);
+	    bl->off = line - b->text;
+	    bl->len = len;
+	    classify(line, len, &bl->m);
+	}
+
+	/* Can't fail; the main thread never has more than
+	 * BATCH_QLEN batches out with one worker.
+	 */
+	ringPush(&w->out, b);
+	if (!atomic_exchange(&pipeWakePending, true))
+	    shmWake(pipeWakeFds[1]);
+    }
+}
+
+/**
+ * Log the classified batches that are next in order.
+ */
+static void
+pipeCommit()
+{
+    Batch *b;
+    int64_t saveTime = lineTime;
+    int saveChild = lineChild;
+    int i;
+
+    while (inflight > 0 && (b = ringPop(&pool[nextCommit].out)) != NULL) {
+	--pool[nextCommit].inflight;
+	--inflight;
+	nextCommit = (nextCommit + 1) % workers;
+	lineTime = b->time;
+	lineChild = b->child;
+	for (i=0; i<b->n; ++i) {
+	    BatchLine *bl = &b->lines[i];
+	    logRecord(&bl->m, b->text + bl->off, bl->len, bl->fd, bl->tid, 0);
+	}
+	b->next = batchFree;
+	batchFree = b;
+    }
+    lineTime = saveTime;
+    lineChild = saveChild;
+}
+
+static void
+pipeReady(int fd, void *arg)
+{
+    wakeClear(fd);
+    /* An exchange rather than a store, so that we see every batch
+     * pushed before the flag was last set.
+     */
+    atomic_exchange(&pipeWakePending, false);
+    pipeCommit();
+}
+
+/**
+ * Wait for a worker to make progress.
+ */
+static void
+pipeWait(int *spins)
+{
+    if (++*spins > 100) {
+	struct timespec ts = {0, 50000};
+	nanosleep(&ts, NULL);
+    } else {
+	sched_yield();
+    }
+}
+
+/**
+ * Hand the current batch to the next worker.
+ */
+static void
+pipeSubmit()
+{
+    Worker *w;
+    int spins = 0;
+
+    if (batch == NULL || batch->n == 0)
+	return;
+    w = &pool[nextSubmit];
+    while (w->inflight >= BATCH_QLEN) {
+	pipeCommit();
+	if (w->inflight >= BATCH_QLEN)
+	    pipeWait(&spins);
+    }
+    ringPush(&w->in, batch);
+    batch = NULL;
+    ++w->inflight;
+    ++inflight;
+    nextSubmit = (nextSubmit + 1) % workers;
+
+    /* Pairs with the sleeping flag: either the worker sees the
+     * batch before it sleeps, or we see that it's sleeping.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&w->sleeping)) {
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/**
+ * Add one line to the current batch.
+ */
+static void
+pipeLine(const char *line, size_t len, short fd)
+{
+    BatchLine *bl;
+
+    if (len > batchSize) {
+	/* Too long for a batch; log it here, in order */
+	pipeFlush();
+	logLine((char *)line, len, fd);
+	return;
+    }
+    if (batch != NULL &&
+	(batch->n >= BATCH_LINES || batch->used + len > batchSize))
+    {
+	pipeSubmit();
+    }
+    if (batch == NULL) {
+	if ((batch = batchFree) != NULL) {
+	    batchFree = batch->next;
+	} else if ((batch = malloc(sizeof(*batch) + batchSize)) == NULL) {
+	    /* Out of memory; log it the slow way, in order */
+	    pipeFlush();
+	    logLine((char *)line, len, fd);
+	    return;
+	}
+	batch->n = 0;
+	batch->used = 0;
+	batch->time = lineTime;
+	batch->child = lineChild;
+    }
+    bl = &batch->lines[batch->n++];
+    bl->off = batch->used;
+    bl->len = len;
+    bl->fd = fd;
+    memcpy(batch->text + batch->used, line, len);
+    batch->used += len;
+}
+
+/**
+ * Submit any partial batch and wait until everything is logged.
+ */
+static void
+pipeFlush()
+{
+    int spins = 0;
+
+    pipeSubmit();
+    while (inflight > 0) {
+	pipeCommit();
+	if (inflight > 0)
+	    pipeWait(&spins);
+    }
+}
+
+/**
+ * Start the worker threads. Returns 0 on success, -1 on error.
+ */
+static int
+pipeStart()
+{
+    int i;
+
+    /* Build the matcher now; the workers share it read-only */
+    matchPrepare();
+
+    /* A line can be as long as the read buffer */
+    batchSize = readbufsize > 64*1024 ? readbufsize : 64*1024;
+    if ((pool = calloc(workers, sizeof(*pool))) == NULL)
+	return -1;
+    if (wakeOpen(pipeWakeFds) < 0)
+	return -1;
+    nonBlocking(pipeWakeFds[0]);
+    if (evAdd(pipeWakeFds[0], pipeReady, NULL) < 0)
+	return -1;
+    atomic_store(&pipeStopping, false);
+    for (i=0; i<workers; ++i) {
+	Worker *w = &pool[i];
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, workerMain, w) != 0) {
+	    perror("pthread_create");
+	    workers = i;
+	    pipeStop();
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Log everything still in the pipeline and stop the workers.
+ */
+static void
+pipeStop()
+{
+    Batch *b;
+    int i;
+
+    if (workers > 0)
+	pipeFlush();
+    atomic_store(&pipeStopping, true);
+    for (i=0; i<workers; ++i) {
+	pthread_mutex_lock(&pool[i].lock);
+	pthread_cond_signal(&pool[i].cond);
+	pthread_mutex_unlock(&pool[i].lock);
+	pthread_join(pool[i].thread, NULL);
+	pthread_mutex_destroy(&pool[i].lock);
+	pthread_cond_destroy(&pool[i].cond);
+    }
+    free(pool);
+    pool = NULL;
+    while ((b = batchFree) != NULL) {
+	batchFree = b->next;
+	free(b);
+    }
+    evDel(pipeWakeFds[0]);
+    close(pipeWakeFds[0]);
+    if (pipeWakeFds[1] != pipeWakeFds[0])
+	close(pipeWakeFds[1]);
+    pipeWakeFds[0] = pipeWakeFds[1] = -1;
+    nextSubmit = nextCommit = 0;
+}
+
+
+
+#pragma mark -- Logging --
+
+#if 0
+void
+AddToLog(const char *line, int fd, long seq, char type)
+{
+    int i;
+    if (nLogBuffer <= 0) return;
+
+    for (i=0; i<nLogBuffer; ++i)
+	if (logbuffers[i]->type == type) {
+	    LogBufferAppend(logbuffers[i], seq, line, fd, type);
+	    return;
+	}
+    /* No match, use the last one as the "catch-all" */
+    LogBufferAppend(logbuffers[nLogBuffer-1], seq, line, fd, type);
+}
+#endif
+
+/* Next message to dump from one buffer */
+typedef struct {
+    LogMsg *msg;
+    LogBuffer *lb;
+} DumpEnt;
+
+/*
+ * LogDump() doesn't write anything itself. It swaps every buffer's
+ * arena for its empty spare, and hands the full ones to the dump
+ * thread, so ingestion is only paused for as long as the swap takes.
+ * The arenas become spares again once they've been written. If a
+ * dump is requested while the previous one is still being written,
+ * LogDump() waits for it.
+ */
+static LogBuffer *dumpSnap;     /* Copies of the buffers being dumped */
+static DumpEnt *dumpHeap;       /* One entry per buffer */
+static int dumpN, dumpMax;
+static int64_t dumpTime;        /* When the dump was requested */
+static long dumpSeq;            /* Last seq in the dump */
+static Buf *dumpTo;             /* If set, a copy for a control socket
+				 * client is put here instead of ofile */
+static int dumpWakeFds[2] = {-1, -1};   /* Tells the event loop it's done */
+static const LogFilter *dumpQ;  /* &dumpFilter, or NULL */
+static LogFilter dumpFilter;
+static char dumpTypes[64];
+static bool dumpBusy;           /* Dump thread is writing */
+static bool dumpStarted;        /* Dump thread exists */
+static pthread_t dumpThread;
+static pthread_mutex_t dumpLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumpCond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Restore the heap property below heap[i], smallest seq on top.
+ */
+static void
+heapDown(DumpEnt *heap, int n, int i)
+{
+    DumpEnt e = heap[i];
+    int c;
+
+    while ((c = 2*i + 1) < n) {
+	if (c+1 < n && heap[c+1].msg->seq < heap[c].msg->seq)
+	    ++c;
+	if (e.msg->seq <= heap[c].msg->seq)
+	    break;
+	heap[i] = heap[c];
+	i = c;
+    }
+    heap[i] = e;
+}
+
+/*
+ * Dump output is formatted into a large page-aligned chunk and sent
+ * with one write() per chunk, bypassing stdio. Text too big for the
+ * chunk is written directly. If 'to' is set, the output is appended
+ * to it instead of written. Once a write fails, the rest is skipped.
+ */
+#define OUT_CHUNK       (1024*1024)
+
+typedef struct {
+    int fd;
+    size_t len, cap;
+    char *buf;
+    Buf *to;
+    bool failed;
+} DumpOut;
+
+static void
+outWrite(DumpOut *o, const char *data, size_t len)
+{
+    if (o->to != NULL)
+	bufPut(o->to, data, len);
+    else if (!o->failed && !writeAll(o->fd, data, len))
+	o->failed = true;
+}
+
+static void
+outFlush(DumpOut *o)
+{
+    outWrite(o, o->buf, o->len);
+    o->len = 0;
+}
+
+static inline void
+outPut(DumpOut *o, const char *data, size_t len)
+{
+    if (o->len + len > o->cap) {
+	outFlush(o);
+	if (len > o->cap) {
+	    outWrite(o, data, len);
+	    return;
+	}
+    }
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+}
+
+static inline void
+outStr(DumpOut *o, const char *str)
+{
+    outPut(o, str, strlen(str));
+}
+
+/* Append n, then the character 'after' */
+static inline void
+outInt(DumpOut *o, long n, char after)
+{
+    char buffer[24], *ptr = buffer + sizeof(buffer);
+    unsigned long u = n < 0 ? -(unsigned long)n : n;
+
+    *--ptr = after;
+    do *--ptr = '0' + u % 10; while ((u /= 10) != 0);
+    if (n < 0) *--ptr = '-';
+    outPut(o, ptr, buffer + sizeof(buffer) - ptr);
+}
+
+/**
+ * Format one message as it appears in a dump.
+ */
+static void
+outLine(DumpOut *o, char type, int fd, int tid, int child, int64_t time,
+    const char *text, size_t len)
+{
+    if (showcolor != NONE)
+	outStr(o, colorStart(type, fd, tid));
+    if (child > 0)
+	outStr(o, childTag(child));
+    if (showfds)
+	outInt(o, fd, ' ');
+    if (showthreads && tid != 0) {
+	outPut(o, "[", 1);
+	outInt(o, tid, ']');
+	outPut(o, " ", 1);
+    }
+    if (timestamps)
+	outStr(o, timeStr(time));
+    outPut(o, text, len);
+    outStr(o, colorStop());
+    outPut(o, "\n", 1);
+}
+
+/**
+ * Set up each buffer's iterator for dumpWrite(), skipping ahead to
+ * q->since if there's a filter. Call from the thread that stores
+ * messages, since the checkpoints change as it does.
+ */
+static void
+dumpPosition(LogBuffer *bufs, int nbufs, const LogFilter *q)
+{
+    int i;
+
+    for (i=0; i<nbufs; ++i) {
+	if (q == NULL) {
+	    LogBufferIterator(&bufs[i]);
+	} else {
+	    lbIterFrom(&bufs[i], q->since);
+	    if (q->types != NULL && strchr(q->types, bufs[i].type) == NULL)
+		bufs[i].iterLeft = 0;
+	}
+    }
+}
+
+/**
+ * Return the next message from lb that passes filter q, or NULL.
+ * A NULL filter passes everything.
+ */
+static LogMsg *
+queryNext(LogBuffer *lb, const LogFilter *q)
+{
+    LogMsg *msg;
+
+    while ((msg = LogBufferNext(lb)) != NULL && q != NULL) {
+	if (msg->time >= q->since &&
+	    (q->until == 0 || msg->time <= q->until) &&
+	    (q->fd < 0 || msg->fd == q->fd) &&
+	    (q->types == NULL || strchr(q->types, msg->type) != NULL))
+	{
+	    break;
+	}
+    }
+    return msg;
+}
+
+/**
+ * Write out a set of buffers positioned by dumpPosition(), merged in
+ * sequence order, to 'fp', or if 'to' is given, append them to it.
+ * If q is given, only the messages that pass it are written.
+ */
+static void
+dumpWrite(LogBuffer *bufs, int nbufs, DumpEnt *heap, int64_t when,
+    const LogFilter *q, FILE *fp, Buf *to)
+{
+    static Buf render;
+    static char *chunk;
+    DumpOut out, *o = &out;
+    int i, n = 0;
+
+    if (chunk == NULL && posix_memalign((void **)&chunk, 4096, OUT_CHUNK))
+	chunk = NULL;
+    if (chunk == NULL) {
+	fprintf(stderr, "Out of memory, can't dump logs\n");
+	return;
+    }
+    /* Anything stdio already has goes first */
+    if (to == NULL) {
+	flockfile(fp);
+	fflush(fp);
+    }
+    o->fd = to == NULL ? fileno(fp) : -1;
+    o->buf = chunk;
+    o->len = 0;
+    o->cap = OUT_CHUNK;
+    o->to = to;
+    o->failed = false;
+
+    outStr(o, q != NULL ? "\nLog query at " : "\nLog dump at ");
+    outStr(o, timeStr(when));
+    outPut(o, "\n\n", 2);
+
+    /* Keep the next message from each buffer in a heap */
+    for (i=0; i<nbufs; ++i) {
+	if ((heap[n].msg = queryNext(&bufs[i], q)) != NULL)
+	    heap[n++].lb = &bufs[i];
+    }
+    for (i = n/2 - 1; i >= 0; --i)
+	heapDown(heap, n, i);
+
+    while (n > 0 && !o->failed)
+    {
+	/* Advancing may decompress over lm, so output it first */
+	LogMsg *lm = heap[0].msg;
+	const char *text = lm->line;
+	size_t len = lm->linelen;
+	char repeated[64];
+
+	if (lm->flags & MSG_REPEAT) {
+	    long count;
+	    memcpy(&count, lm->line, sizeof(count));
+	    len = snprintf(repeated, sizeof(repeated),
+		"last message repeated %ld %s", count,
+		count == 1 ? "time" : "times");
+	    text = repeated;
+	} else if (lm->flags & MSG_DEFERRED) {
+	    text = msgText(lm->line, lm->linelen, true, &len, &render);
+	}
+	outLine(o, lm->type, lm->fd, lm->tid, lm->child, lm->time, text, len);
+	if ((heap[0].msg = queryNext(heap[0].lb, q)) == NULL)
+	    heap[0] = heap[--n];
+	if (n > 0)
+	    heapDown(heap, n, 0);
+    }
+    outFlush(o);
+    if (to == NULL)
+	funlockfile(fp);
+}
+
+static void *
+dumpMain(void *arg)
+{
+    int64_t start;
+    int i;
+
+    pthread_mutex_lock(&dumpLock);
+    for (;;) {
+	while (!dumpBusy)
+	    pthread_cond_wait(&dumpCond, &dumpLock);
+	pthread_mutex_unlock(&dumpLock);
+	start = nowNs();
+	dumpWrite(dumpSnap, dumpN, dumpHeap, dumpTime, dumpQ, ofile, dumpTo);
+	if (dumpTo == NULL)
+	    for (i=0; i<dumpN; ++i)
+		lbDumped(&dumpSnap[i], dumpSeq);
+	/* Under a budget, the dumped arenas' pages go back to the
+	 * system now, rather than sit in the spares until reused.
+	 */
+	for (i=0; membudget > 0 && i<dumpN; ++i)
+	    pagesRelease(dumpSnap[i].arena, dumpSnap[i].limit);
+	pthread_mutex_lock(&dumpLock);
+	histAdd(&stats.dumpNs, nowNs() - start);
+	dumpBusy = false;
+	pthread_cond_broadcast(&dumpCond);
+	/* The event loop sends copies and starts queued ones */
+	if (dumpWakeFds[1] >= 0)
+	    shmWake(dumpWakeFds[1]);
+    }
+    return NULL;
+}
+
+/**
+ * Wait for the dump in progress, if any, to be written.
+ */
+void
+LogDumpWait()
+{
+    int i;
+
+    pthread_mutex_lock(&dumpLock);
+    while (dumpBusy)
+	pthread_cond_wait(&dumpCond, &dumpLock);
+    pthread_mutex_unlock(&dumpLock);
+
+    /* The dumped arenas are the new spares */
+    for (i=0; i<dumpN; ++i)
+	logbuffers[i]->spare = dumpSnap[i].arena;
+    dumpN = 0;
+    if (dumpTo != NULL) {
+	dumpTo = NULL;
+	ctlCopyDone();
+    }
+}
+
+/**
+ * Make sure dumpSnap and dumpHeap have room for every buffer.
+ */
+static bool
+dumpReserve()
+{
+    if (nLogBuffer > dumpMax) {
+	LogBuffer *snap = realloc(dumpSnap, nLogBuffer * sizeof(*snap));
+	DumpEnt *heap = realloc(dumpHeap, nLogBuffer * sizeof(*heap));
+	if (snap != NULL) dumpSnap = snap;
+	if (heap != NULL) dumpHeap = heap;
+	if (snap == NULL || heap == NULL) {
+	    fprintf(stderr, "Out of memory, can't dump logs\n");
+	    return false;
+	}
+	dumpMax = nLogBuffer;
+    }
+    return true;
+}
+
+/**
+ * Start the dump thread if it isn't running. Returns false if it
+ * can't be started.
+ */
+static bool
+dumpThreadStart()
+{
+    if (!dumpStarted) {
+	dumpStarted = pthread_create(&dumpThread, NULL, dumpMain, NULL) == 0;
+	if (dumpStarted)
+	    pthread_detach(dumpThread);
+    }
+    return dumpStarted;
+}
+
+/**
+ * Hand the buffers in dumpSnap to the dump thread.
+ */
+static void
+dumpSignal()
+{
+    pthread_mutex_lock(&dumpLock);
+    dumpBusy = true;
+    pthread_cond_signal(&dumpCond);
+    pthread_mutex_unlock(&dumpLock);
+}
+
+/**
+ * Write out the messages that pass filter q, without clearing
+ * anything. The buffers are read in place, so this runs in the
+ * thread that stores messages, after any dump in progress.
+ */
+void
+LogQuery(const LogFilter *q)
+{
+    int i;
+
+    /* The dump thread shares each buffer's unpack space */
+    LogDumpWait();
+    if (!dumpReserve()) return;
+    for (i=0; i<nLogBuffer; ++i)
+	dumpSnap[i] = *logbuffers[i];
+    dumpPosition(dumpSnap, nLogBuffer, q);
+    dumpWrite(dumpSnap, nLogBuffer, dumpHeap, nowNs(), q, ofile, NULL);
+}
+
+/**
+ * Like LogQuery(), but append the text to 'to'. If every buffer has
+ * its spare, the messages are copied into the spares and formatted by
+ * the dump thread, and LogDumpWait() calls ctlCopyDone() once they
+ * are. Otherwise it's done before this returns.
+ */
+static void
+dumpCopy(Buf *to, const LogFilter *q)
+{
+    bool background = true;
+    int i;
+
+    LogDumpWait();
+    if (!dumpReserve())
+	return;
+    for (i=0; i<nLogBuffer; ++i)
+	if (logbuffers[i]->spare == NULL)
+	    background = false;
+
+    if (!dumpThreadStart() || !background) {
+	for (i=0; i<nLogBuffer; ++i)
+	    dumpSnap[i] = *logbuffers[i];
+	dumpPosition(dumpSnap, nLogBuffer, q);
+	dumpWrite(dumpSnap, nLogBuffer, dumpHeap, nowNs(), q, NULL, to);
+	return;
+    }
+
+    for (i=0; i<nLogBuffer; ++i) {
+	LogBuffer *lb = logbuffers[i];
+	char *copy = lb->spare;
+	if (lb->ring != NULL) lbSpareClear(lb);
+	if (lb->nmsgs > 0 && lb->tail <= lb->head) {
+	    memcpy(copy + lb->head, lb->arena + lb->head, lb->wrap - lb->head);
+	    memcpy(copy, lb->arena, lb->tail);
+	} else {
+	    memcpy(copy + lb->head, lb->arena + lb->head, lb->tail - lb->head);
+	}
+	dumpSnap[i] = *lb;
+	dumpSnap[i].arena = copy;
+	lb->spare = NULL;
+    }
+    /* The checkpoints are only good in this thread */
+    dumpPosition(dumpSnap, nLogBuffer, q);
+    dumpN = nLogBuffer;
+    dumpTime = nowNs();
+    dumpTo = to;
+    dumpQ = NULL;
+    if (q != NULL) {
+	dumpFilter = *q;
+	if (q->types != NULL) {
+	    snprintf(dumpTypes, sizeof(dumpTypes), "%s", q->types);
+	    dumpFilter.types = dumpTypes;
+	}
+	dumpQ = &dumpFilter;
+    }
+    dumpSignal();
+}
+
+/**
+ * Dump logs and clear them
+ * Log collection continues. Normally called from LogParent() when
+ * the child exits, a trigger string is seen in the logs, or SIGUSR1 received.
+ * The logs are written in the background; see LogDumpWait().
+ */
+void
+LogDump()
+{
+    int64_t start = nowNs(), paused;
+    bool background = true;
+    int i;
+
+    LogDumpWait();
+    if (!dumpReserve()) return;
+    for (i=0; i<nLogBuffer; ++i)
+	if (logbuffers[i]->spare == NULL)
+	    background = false;
+
+    ++stats.dumps;
+    if (!dumpThreadStart() || !background) {
+	/* Do it the slow way */
+	for (i=0; i<nLogBuffer; ++i)
+	    dumpSnap[i] = *logbuffers[i];
+	dumpPosition(dumpSnap, nLogBuffer, NULL);
+	dumpWrite(dumpSnap, nLogBuffer, dumpHeap, start, NULL, ofile, NULL);
+	for (i=0; i<nLogBuffer; ++i) {
+	    lbDumped(logbuffers[i], seq);
+	    LogBufferClear(logbuffers[i]);
+	}
+	paused = nowNs() - start;
+	histAdd(&stats.pauseNs, paused);
+	pthread_mutex_lock(&dumpLock);
+	histAdd(&stats.dumpNs, paused);
+	pthread_mutex_unlock(&dumpLock);
+	return;
+    }
+
+    for (i=0; i<nLogBuffer; ++i) {
+	LogBuffer *lb = logbuffers[i];
+	dumpSnap[i] = *lb;
+	lb->arena = lb->spare;
+	lb->spare = NULL;
+	lb->region ^= 1;
+	LogBufferClear(lb);
+    }
+    dumpPosition(dumpSnap, nLogBuffer, NULL);
+    dumpN = nLogBuffer;
+    dumpTime = start;
+    dumpSeq = seq;
+    dumpTo = NULL;
+    dumpQ = NULL;
+    paused = nowNs() - start;
+    histAdd(&stats.pauseNs, paused);
+    dumpSignal();
+
+    fprintf(stderr, "Logging paused %.1f us for dump\n", paused / 1000.0);
+}
+
+/**
+ * Match this line against all patterns and return the buffer
+ * it belongs in. If sevparse is set, the buffer comes from the
+ * line's severity field instead, when it has one.
+ */
+static LogBuffer *
+classify(const char *line, size_t len, LineMatch *m)
+{
+    if (sevparse == SEV_PATTERNS || !sevMatch(line, len, m))
+	matchLine(line, len, m);
+    return logbuffers[m->buffer];
+}
+
+#pragma mark -- Control socket --
+
+/*
+ * With ctlpath set, LogParent() listens on a Unix-domain socket for
+ * commands, one line per connection:
+ *
+ *      dump                    Copy of all the logs; nothing is cleared
+ *      query [since=T] [until=T] [fd=N] [types=S]
+ *                              Just the logs that pass the filter
+ *      tail [fd=N] [types=S]   Stream messages as they're logged
+ *      stats                   Statistics, as for SIGUSR2
+ *      json                    The same, as JSON
+ *      flush                   Dump and clear, as for SIGUSR1
+ *
+ * T is a duration as for LogTimeAgo(). dump and query are copied and
+ * formatted by the dump thread, as for a background LogDump(). The
+ * copy is a memcpy of the used part of every buffer into its spare,
+ * done in the event loop, so each one costs about as much as the
+ * logs take up. Only one is made at a time: the rest are queued
+ * and started in turn as the dump thread finishes, rather than
+ * waited for. The text is then sent by the event loop like tail
+ * output, and the connection closed once it's all gone, so a client
+ * that stops reading never holds up a dump. One that takes no more
+ * for CTL_TIMEOUT seconds is dropped. A client may shut down its
+ * side once it has sent its command; it's only dropped early if a
+ * write to it fails. Each tail subscriber has a bounded
+ * queue, flushed once per pass of the event loop. When a subscriber
+ * can't keep up its messages are dropped, and it's told how many, so
+ * logging never waits for it.
+ */
+
+#define CTL_LINE        1024            /* Longest command */
+#define CTL_QUEUE       (256*1024)      /* Tail output queued per client */
+#define CTL_TIMEOUT     10              /* Seconds a copy waits on a client */
+
+typedef struct Ctl {
+    int fd;
+    char line[CTL_LINE];
+    size_t linelen;
+    bool tail;          /* Subscribed to new messages */
+    bool waiting;       /* Waiting for the socket to be writable */
+    bool queued;        /* Its copy waits for the dump thread */
+    bool query;         /* The copy is filtered by q */
+    bool copying;       /* Its copy is being formatted */
+    bool closing;       /* Close once out has been sent */
+    bool eof;           /* It has sent all it's going to */
+    int64_t sent;       /* When output last went out */
+    LogFilter q;
+    char types[64];
+    Buf out;            /* Tail output not yet sent */
+    long dropped;       /* Messages dropped since the last notice */
+    struct Ctl *next;
+} Ctl;
+
+static int ctlFd = -1;
+static Ctl *ctlList;
+static Ctl *ctlCopier;          /* Client the dump thread's copy is for */
+static Buf ctlCopyText;         /* Where the dump thread puts it */
+
+/**
+ * Return the time 'duration' ago, in ns.
+ */
+int64_t
+LogTimeAgo(const char *duration)
+{
+    char *end;
+    double t = strtod(duration, &end);
+
+    switch (*end) {
+      case 'd': t *= 24;        /* fall through */
+      case 'h': t *= 60;        /* fall through */
+      case 'm': t *= 60;        /* fall through */
+      case 's': ++end; break;
+    }
+    if (end == duration || *end != '\0' || t < 0)
+	return -1;
+    return nowNs() - (int64_t)(t * 1e9);
+}
+
+static void
+ctlReply(Ctl *c, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    bufPrintf(&c->out, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Close a client connection and forget it.
+ */
+static void
+ctlDrop(Ctl *c)
+{
+    Ctl **pp;
+
+    for (pp = &ctlList; *pp != NULL; pp = &(*pp)->next)
+	if (*pp == c) {
+	    *pp = c->next;
+	    break;
+	}
+    if (c->tail) --ctlTailing;
+    if (c->closing) --ctlSending;
+    if (c == ctlCopier) ctlCopier = NULL;
+    evDel(c->fd);
+    close(c->fd);
+    free(c->out.buf);
+    free(c);
+}
+
+/**
+ * Send as much queued output as the socket will take. Returns false
+ * if the client went away, in which case it's been dropped.
+ */
+static bool
+ctlSend(Ctl *c)
+{
+    ssize_t n;
+
+    while (c->out.len > 0) {
+	if ((n = write(c->fd, c->out.buf, c->out.len)) < 0) {
+	    if (errno == EINTR) continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		if (!c->waiting) evOut(c->fd, true);
+		c->waiting = true;
+		return true;
+	    }
+	    ctlDrop(c);
+	    return false;
+	}
+	c->out.len -= n;
+	memmove(c->out.buf, c->out.buf + n, c->out.len);
+	c->sent = nowNs();
+    }
+    if (c->waiting) evOut(c->fd, false);
+    c->waiting = false;
+    return true;
+}
+
+/**
+ * Parse "key=value" arguments into a filter. Returns false, with an
+ * error queued for the client, on a bad one.
+ */
+static bool
+ctlFilter(Ctl *c, char *args, LogFilter *q)
+{
+    char *arg, *last, *val;
+
+    q->since = q->until = 0;
+    q->fd = -1;
+    q->types = NULL;
+    for (arg = strtok_r(args, " \t", &last); arg != NULL;
+	 arg = strtok_r(NULL, " \t", &last))
+    {
+	if ((val = strchr(arg, '=')) == NULL) goto bad;
+	*val++ = '\0';
+	if (strcmp(arg, "since") == 0) {
+	    if ((q->since = LogTimeAgo(val)) < 0) goto bad;
+	} else if (strcmp(arg, "until") == 0) {
+	    if ((q->until = LogTimeAgo(val)) < 0) goto bad;
+	} else if (strcmp(arg, "fd") == 0 && isdigit(*val)) {
+	    q->fd = atoi(val);
+	} else if (strcmp(arg, "types") == 0) {
+	    snprintf(c->types, sizeof(c->types), "%s", val);
+	    q->types = c->types;
+	} else {
+	    goto bad;
+	}
+    }
+    return true;
+
+bad:
+    ctlReply(c, "Bad argument: %s\n", arg);
+    return false;
+}
+
+/**
+ * If the dump thread is free, start the copy for the client that's
+ * waited longest. Copies that don't need the thread are done here,
+ * so keep going until one does or there are none left.
+ */
+static void
+ctlCopyNext()
+{
+    Ctl *c, *next;
+    bool busy;
+
+    for (;;) {
+	pthread_mutex_lock(&dumpLock);
+	busy = dumpBusy;
+	pthread_mutex_unlock(&dumpLock);
+	if (busy)
+	    return;
+	/* Doesn't wait; just hands over the last copy, if any */
+	LogDumpWait();
+	/* New clients go on the front, so the oldest is last */
+	for (next = NULL, c = ctlList; c != NULL; c = c->next)
+	    if (c->queued) next = c;
+	if (next == NULL)
+	    return;
+	next->queued = false;
+	ctlCopier = next;
+	dumpCopy(&ctlCopyText, next->query ? &next->q : NULL);
+	if (dumpTo == NULL)
+	    ctlCopyDone();
+    }
+}
+
+/**
+ * Queue a copy of the logs for this client, filtered by c->q if
+ * 'query'. It's sent once the dump thread has formatted it; see
+ * ctlCopyDone().
+ */
+static void
+ctlCopy(Ctl *c, bool query)
+{
+    c->queued = c->copying = c->closing = true;
+    c->query = query;
+    c->sent = nowNs();
+    ++ctlSending;
+    ctlCopyNext();
+}
+
+/**
+ * Queue the finished copy for its client, if it's still there.
+ * ctlFlush() sends it.
+ */
+static void
+ctlCopyDone()
+{
+    Ctl *c = ctlCopier;
+    Buf tmp;
+
+    ctlCopier = NULL;
+    if (c != NULL) {
+	c->copying = false;
+	c->sent = nowNs();
+	if (c->out.len > 0) {
+	    bufPut(&c->out, ctlCopyText.buf, ctlCopyText.len);
+	} else {
+	    /* Swap, so the big buffer goes when the client does */
+	    tmp = c->out;
+	    c->out = ctlCopyText;
+	    ctlCopyText = tmp;
+	}
+    }
+    ctlCopyText.len = 0;
+}
+
+/**
+ * The dump thread has finished a copy or a dump.
+ */
+static void
+ctlCopyReady(int fd, void *arg)
+{
+    wakeClear(fd);
+    ctlCopyNext();
+}
+
+/**
+ * Carry out the command in c->line. Returns true if the client
+ * stays connected.
+ */
+static bool
+ctlCommand(Ctl *c)
+{
+    char *cmd, *args;
+
+    cmd = c->line + strspn(c->line, " \t");
+    args = cmd + strcspn(cmd, " \t");
+    if (*args != '\0') *args++ = '\0';
+
+    if (strcmp(cmd, "dump") == 0) {
+	ctlCopy(c, false);
+	return true;
+    } else if (strcmp(cmd, "query") == 0) {
+	if (ctlFilter(c, args, &c->q)) {
+	    ctlCopy(c, true);
+	    return true;
+	}
+    } else if (strcmp(cmd, "tail") == 0) {
+	if (ctlFilter(c, args, &c->q)) {
+	    c->tail = true;
+	    ++ctlTailing;
+	    return true;
+	}
+    } else if (strcmp(cmd, "stats") == 0) {
+	statsText(&c->out);
+	ctlReply(c, "tail subscribers %d\n", ctlTailing);
+    } else if (strcmp(cmd, "json") == 0) {
+	statsJson(&c->out);
+    } else if (strcmp(cmd, "flush") == 0) {
+	drainInputs();
+	LogDump();
+	ctlReply(c, "Dumped\n");
+    } else {
+	ctlReply(c, "Unknown command: %s\n", cmd);
+    }
+    return false;
+}
+
+/**
+ * Input or, if we asked, room for output on a client connection.
+ */
+static void
+ctlReady(int fd, void *arg)
+{
+    Ctl *c = arg;
+    char buffer[256];
+    ssize_t n;
+
+    if (c->eof && !c->waiting) {
+	/* Not watching for input, so it's hung up altogether, and
+	 * any write would fail.
+	 */
+	ctlDrop(c);
+	return;
+    }
+    if ((c->tail || c->closing) && !c->eof) {
+	/* Nothing more is expected, but notice if it's gone */
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0);
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+	    ctlDrop(c);
+	    return;
+	}
+	/* Having shut down its side, it may still be reading */
+	if (n == 0) {
+	    c->eof = true;
+	    evIn(fd, false);
+	}
+    }
+    if (c->tail || c->closing) {
+	if (ctlSend(c) && c->closing && !c->copying && c->out.len == 0)
+	    ctlDrop(c);
+	return;
+    }
+
+    while ((n = read(fd, c->line + c->linelen,
+		     sizeof(c->line) - 1 - c->linelen)) > 0)
+    {
+	char *nl;
+	c->linelen += n;
+	c->line[c->linelen] = '\0';
+	if ((nl = strchr(c->line, '\n')) != NULL) {
+	    if (nl > c->line && nl[-1] == '\r') --nl;
+	    *nl = '\0';
+	    if (!ctlCommand(c) && ctlSend(c))
+		ctlDrop(c);
+	    return;
+	}
+	if (c->linelen >= sizeof(c->line) - 1) {
+	    ctlDrop(c);
+	    return;
+	}
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	ctlDrop(c);
+}
+
+/**
+ * Accept new client connections.
+ */
+static void
+ctlAccept(int fd, void *arg)
+{
+    int cfd;
+
+    while ((cfd = accept(fd, NULL, NULL)) >= 0) {
+	Ctl *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+	    close(cfd);
+	    continue;
+	}
+	nonBlocking(cfd);
+	c->fd = cfd;
+	if (evAdd(cfd, ctlReady, c) < 0) {
+	    close(cfd);
+	    free(c);
+	    continue;
+	}
+	c->next = ctlList;
+	ctlList = c;
+    }
+}
+
+/**
+ * Start listening on ctlpath. Returns 0 on success, -1 on error.
+ */
+static int
+ctlListen()
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(ctlpath) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: path too long\n", ctlpath);
+	return -1;
+    }
+    strcpy(addr.sun_path, ctlpath);
+    if ((ctlFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	return -1;
+    }
+    unlink(ctlpath);
+    if (bind(ctlFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(ctlFd, 16) < 0)
+    {
+	perror(ctlpath);
+	close(ctlFd);
+	ctlFd = -1;
+	return -1;
+    }
+    nonBlocking(ctlFd);
+    if (evAdd(ctlFd, ctlAccept, NULL) < 0) {
+	close(ctlFd);
+	ctlFd = -1;
+	return -1;
+    }
+    /* Copies for clients are sent once the dump thread says so */
+    if (wakeOpen(dumpWakeFds) == 0) {
+	nonBlocking(dumpWakeFds[0]);
+	evAdd(dumpWakeFds[0], ctlCopyReady, NULL);
+    }
+    /* Clients that go away mustn't take us with them */
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+/**
+ * Stop listening and disconnect every client.
+ */
+static void
+ctlClose()
+{
+    if (ctlFd < 0) return;
+    LogDumpWait();
+    if (dumpWakeFds[0] >= 0) {
+	evDel(dumpWakeFds[0]);
+	close(dumpWakeFds[0]);
+	if (dumpWakeFds[1] != dumpWakeFds[0])
+	    close(dumpWakeFds[1]);
+	dumpWakeFds[0] = dumpWakeFds[1] = -1;
+    }
+    while (ctlList != NULL) {
+	if (ctlList->dropped > 0)
+	    ctlReply(ctlList, "(superlog: %ld messages dropped)\n",
+		     ctlList->dropped);
+	ctlSend(ctlList);
+	if (ctlList != NULL) ctlDrop(ctlList);
+    }
+    evDel(ctlFd);
+    close(ctlFd);
+    unlink(ctlpath);
+    ctlFd = -1;
+}
+
+/**
+ * Queue a newly logged message for every tail subscriber that wants
+ * it. It's only formatted if someone does.
+ */
+static void
+ctlTail(char type, short fd, int tid, const char *data, size_t len,
+    int flags)
+{
+    static Buf line, render;
+    char scratch[256];
+    DumpOut o = {-1, 0, sizeof(scratch), scratch, &line, false};
+    Ctl *c;
+
+    line.len = 0;
+    for (c = ctlList; c != NULL; c = c->next) {
+	if (!c->tail || (c->q.fd >= 0 && c->q.fd != fd) ||
+	    (c->q.types != NULL && strchr(c->q.types, type) == NULL))
+	{
+	    continue;
+	}
+	if (line.len == 0) {
+	    size_t tlen;
+	    const char *text = msgText(data, len, flags & MSG_DEFERRED,
+				       &tlen, &render);
+	    outLine(&o, type, fd, tid, lineChild, lineTime, text, tlen);
+	    outFlush(&o);
+	}
+	if (c->dropped > 0 && c->out.len + line.len + 64 <= CTL_QUEUE) {
+	    ctlReply(c, "(superlog: %ld messages dropped)\n", c->dropped);
+	    c->dropped = 0;
+	}
+	if (c->dropped > 0 || c->out.len + line.len > CTL_QUEUE)
+	    ++c->dropped;
+	else
+	    bufPut(&c->out, line.buf, line.len);
+    }
+}
+
+/**
+ * Send what's been queued for the tail subscribers, and the copies
+ * for dump and query clients. A copy client is closed once it's
+ * been sent everything, or dropped if it stops reading.
+ */
+static void
+ctlFlush()
+{
+    Ctl *c, *next;
+
+    for (c = ctlList; c != NULL; c = next) {
+	next = c->next;
+	if (c->out.len > 0 && !c->waiting && (c->tail || c->closing) &&
+	    !ctlSend(c))
+	{
+	    continue;
+	}
+	if (c->closing && !c->copying &&
+	    (c->out.len == 0 ||
+	     nowNs() - c->sent > CTL_TIMEOUT * 1000000000LL))
+	{
+	    ctlDrop(c);
+	}
+    }
+}
+
+
+#pragma mark -- Statistics --
+
+/*
+ * The parent counts what it does as it goes: lines read, excluded and
+ * collapsed, per-buffer lines and evictions, reads and partial-line
+ * moves in NBFileRead(), how full each pipe has been (see
+ * pipeSample()), and histograms of batch sizes, per-line cost and
+ * dump times. It's all plain increments in the logging thread, so
+ * it's always on. The report goes to stderr on SIGUSR2 and at exit,
+ * to the control socket's "stats" and "json" commands, and as JSON
+ * to statsfile every statsinterval seconds, if that's set.
+ */
+
+static void
+histAdd(Hist *h, int64_t v)
+{
+    int b = 0;
+
+    if (v < 0) v = 0;
+    if (v > 0) {
+	b = 64 - __builtin_clzll((unsigned long long)v);
+	if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    }
+    ++h->bucket[b];
+    ++h->count;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/**
+ * Return an upper bound on the value below which a fraction p of
+ * the samples fall.
+ */
+static int64_t
+histPct(const Hist *h, double p)
+{
+    long want = h->count * p, have = 0;
+    int b;
+
+    for (b=0; b<HIST_BUCKETS-1; ++b)
+	if ((have += h->bucket[b]) > want)
+	    break;
+    return (1LL << b) < h->max ? (1LL << b) : h->max;
+}
+
+static void
+statsPrintf(Buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    bufPrintf(b, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Format a duration in ns with sensible units.
+ */
+static const char *
+durStr(int64_t ns, char *buffer, size_t size)
+{
+    if (ns < 10000)
+	snprintf(buffer, size, "%lld ns", (long long)ns);
+    else if (ns < 10000000)
+	snprintf(buffer, size, "%.1f us", ns / 1e3);
+    else if (ns < 10000000000LL)
+	snprintf(buffer, size, "%.1f ms", ns / 1e6);
+    else
+	snprintf(buffer, size, "%.1f s", ns / 1e9);
+    return buffer;
+}
+
+static void
+histText(Buf *b, const char *name, const Hist *h, bool ns)
+{
+    char v[4][24];
+    int64_t vals[4];
+    int i;
+
+    if (h->count == 0) {
+	statsPrintf(b, "%-14s none\n", name);
+	return;
+    }
+    vals[0] = h->sum / h->count;
+    vals[1] = histPct(h, 0.5);
+    vals[2] = histPct(h, 0.99);
+    vals[3] = h->max;
+    for (i=0; i<4; ++i)
+	if (ns)
+	    durStr(vals[i], v[i], sizeof(v[i]));
+	else
+	    snprintf(v[i], sizeof(v[i]), "%lld", (long long)vals[i]);
+    statsPrintf(b, "%-14s %ld, mean %s, p50 <= %s, p99 <= %s, max %s\n",
+	name, h->count, v[0], v[1], v[2], v[3]);
+}
+
+static void
+histJson(Buf *b, const char *name, const Hist *h)
+{
+    int i, n;
+
+    for (n = HIST_BUCKETS; n > 0 && h->bucket[n-1] == 0; --n);
+    statsPrintf(b, "  \"%s\": {\"count\": %ld, \"sum\": %lld, \"max\": %lld, "
+	"\"buckets\": [", name, h->count, (long long)h->sum,
+	(long long)h->max);
+    for (i=0; i<n; ++i)
+	statsPrintf(b, "%s%ld", i > 0 ? ", " : "", h->bucket[i]);
+    statsPrintf(b, "]}");
+}
+
+/**
+ * The dump thread adds to dumpNs, so read it under the lock.
+ */
+static Hist
+statsDumpNs()
+{
+    Hist h;
+    pthread_mutex_lock(&dumpLock);
+    h = stats.dumpNs;
+    pthread_mutex_unlock(&dumpLock);
+    return h;
+}
+
+/**
+ * Append the human-readable report to b.
+ */
+static void
+statsText(Buf *b)
+{
+    Hist dumpNs = statsDumpNs();
+    char up[24];
+    int i;
+
+    statsPrintf(b, "superlog stats, up %s\n",
+	durStr(nowNs() - stats.start, up, sizeof(up)));
+    statsPrintf(b, "%-14s %ld, %ld bytes in %ld reads\n", "lines",
+	stats.lines, stats.bytes, stats.reads);
+    statsPrintf(b, "%-14s %ld\n", "excluded", stats.excluded);
+    statsPrintf(b, "%-14s %ld\n", "repeats", stats.repeats);
+    statsPrintf(b, "%-14s %ld\n", "after trigger", stats.ignored);
+    statsPrintf(b, "%-14s %ld, %ld bytes\n", "partial moves",
+	stats.moves, stats.moveBytes);
+    statsPrintf(b, "%-14s %ld, %ld bytes cut\n", "truncated",
+	stats.truncated, stats.truncBytes);
+    for (i=0; i<nLogBuffer; ++i) {
+	LogBuffer *lb = logbuffers[i];
+	statsPrintf(b, "buffer %c       %s%ld lines, %ld evicted, "
+	    "%ld of %ld bytes used", lb->type, childTag(lb->child),
+	    lb->classified, lb->evicted, lb->allocated,
+	    membudget > 0 ? membudget : lb->limit);
+	if (membudget > 0)
+	    statsPrintf(b, ", min %ld, priority %d", lb->min, lb->priority);
+	statsPrintf(b, "\n");
+    }
+    if (membudget > 0)
+	statsPrintf(b, "%-14s %ld of %ld bytes used, %ld reclaims, "
+	    "%ld bytes\n", "budget", budgetUsed, membudget, stats.reclaims,
+	    stats.reclaimBytes);
+    for (i=0; i<nInputs; ++i) {
+	Input *in = &inputs[i];
+	int64_t near = in->nearNs;
+	if (in->nearSince != 0) near += nowNs() - in->nearSince;
+	statsPrintf(b, "fd %-11d %s%d byte pipe, high water %d%%, "
+	    "near full %ld times, %s\n", in->ofd, childTag(in->child),
+	    in->capacity,
+	    (int)(in->highWater * 100LL / in->capacity), in->nearFull,
+	    durStr(near, up, sizeof(up)));
+    }
+    if (stats.shed > 0)
+	statsPrintf(b, "%-14s %ld\n", "echo skipped", stats.shed);
+    histText(b, "lines per read", &stats.batch, false);
+    histText(b, "time per line", &stats.lineNs, true);
+    statsPrintf(b, "%-14s %ld\n", "dumps", stats.dumps);
+    histText(b, "dump pause", &stats.pauseNs, true);
+    histText(b, "dump write", &dumpNs, true);
+}
+
+/**
+ * Append the report to b as a JSON object. Histogram bucket i counts
+ * values below 2^i; times are in ns.
+ */
+static void
+statsJson(Buf *b)
+{
+    Hist dumpNs = statsDumpNs();
+    int64_t now = nowNs();
+    int i;
+
+    statsPrintf(b, "{\n  \"time\": %.3f,\n  \"uptime\": %.3f,\n",
+	now / 1e9, (now - stats.start) / 1e9);
+    statsPrintf(b, "  \"lines\": %ld,\n  \"bytes\": %ld,\n  \"reads\": %ld,\n"
+	"  \"excluded\": %ld,\n  \"repeats\": %ld,\n  \"after_trigger\": %ld,\n"
+	"  \"partial_moves\": %ld,\n  \"partial_move_bytes\": %ld,\n"
+	"  \"truncated\": %ld,\n  \"truncated_bytes\": %ld,\n"
+	"  \"dumps\": %ld,\n  \"buffers\": [",
+	stats.lines, stats.bytes, stats.reads, stats.excluded,
+	stats.repeats, stats.ignored, stats.moves, stats.moveBytes,
+	stats.truncated, stats.truncBytes, stats.dumps);
+    for (i=0; i<nLogBuffer; ++i) {
+	LogBuffer *lb = logbuffers[i];
+	statsPrintf(b, "%s\n    {\"type\": \"%c\", \"child\": %d, "
+	    "\"lines\": %ld, \"evicted\": %ld, \"used\": %ld, \"limit\": %ld, "
+	    "\"min\": %ld, \"priority\": %d}",
+	    i > 0 ? "," : "", lb->type, lb->child, lb->classified,
+	    lb->evicted, lb->allocated, lb->limit, lb->min, lb->priority);
+    }
+    statsPrintf(b, "\n  ],\n  \"budget\": {\"limit\": %ld, \"used\": %ld, "
+	"\"reclaims\": %ld, \"reclaim_bytes\": %ld},\n  \"pipes\": [",
+	membudget, budgetUsed, stats.reclaims, stats.reclaimBytes);
+    for (i=0; i<nInputs; ++i) {
+	Input *in = &inputs[i];
+	int64_t near = in->nearNs;
+	if (in->nearSince != 0) near += now - in->nearSince;
+	statsPrintf(b, "%s\n    {\"fd\": %d, \"child\": %d, \"capacity\": %d, "
+	    "\"high_water\": %d, \"near_full\": %ld, \"near_full_ns\": %lld}",
+	    i > 0 ? "," : "", in->ofd, in->child, in->capacity,
+	    in->highWater, in->nearFull, (long long)near);
+    }
+    statsPrintf(b, "\n  ],\n  \"echo_skipped\": %ld,\n", stats.shed);
+    histJson(b, "batch_lines", &stats.batch);
+    statsPrintf(b, ",\n");
+    histJson(b, "line_ns", &stats.lineNs);
+    statsPrintf(b, ",\n");
+    histJson(b, "dump_pause_ns", &stats.pauseNs);
+    statsPrintf(b, ",\n");
+    histJson(b, "dump_write_ns", &dumpNs);
+    statsPrintf(b, "\n}\n");
+}
+
+/**
+ * Write the human-readable report to fp.
+ */
+static void
+statsReport(FILE *fp)
+{
+    Buf b = {NULL, 0, 0, NULL};
+
+    statsText(&b);
+    if (b.len > 0)
+	fwrite(b.buf, 1, b.len, fp);
+    fflush(fp);
+    free(b.buf);
+}
+
+/**
+ * How long the event loop may wait before statsfile is due, in ms.
+ */
+static int
+statsTimeout()
+{
+    int64_t wait;
+
+    if (statsfile == NULL)
+	return -1;
+    if (stats.nextFile == 0)
+	stats.nextFile = stats.start + statsinterval * 1000000000LL;
+    wait = (stats.nextFile - nowNs()) / 1000000;
+    return wait > 0 ? (wait < INT_MAX ? wait : INT_MAX) : 0;
+}
+
+/**
+ * Write statsfile if it's due. It's written to a temporary file and
+ * renamed, so readers never see half a report.
+ */
+static void
+statsTick()
+{
+    int64_t now = nowNs();
+    Buf b = {NULL, 0, 0, NULL};
+    char tmp[PATH_MAX];
+    FILE *fp;
+
+    if (stats.nextFile != 0 && now < stats.nextFile)
+	return;
+    stats.nextFile = now + statsinterval * 1000000000LL;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", statsfile);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+	perror(tmp);
+	return;
+    }
+    statsJson(&b);
+    if (b.len > 0)
+	fwrite(b.buf, 1, b.len, fp);
+    free(b.buf);
+    if (fclose(fp) != 0 || rename(tmp, statsfile) < 0) {
+	perror(statsfile);
+	unlink(tmp);
+    }
+}
+
+
+
+#pragma mark -- Block compression --
+
+/*
+ * A small LZ77 codec in the style of LZ4: each sequence is a token
+ * byte holding the literal and match lengths, the literals, and a
+ * 16-bit offset back to the match. Lengths of 15 or more continue in
+ * following bytes. The last sequence has literals only. Log lines
+ * repeat a lot, so this does well without needing to be clever.
+ */
+
+#define LZ_MINMATCH     4
+#define LZ_HASHBITS     13
+#define LZ_MAXOFF       65535
+
+static inline uint32_t
+lzRead32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Write a length continuation; returns new op, or NULL if out of room */
+static unsigned char *
+lzLength(unsigned char *op, unsigned char *oend, long len)
+{
+    for (; len >= 255; len -= 255) {
+	if (op >= oend) return NULL;
+	*op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = len;
+    return op;
+}
+
+/* Write one sequence; returns new op, or NULL if out of room */
+static unsigned char *
+lzSequence(unsigned char *op, unsigned char *oend,
+    const unsigned char *lit, long litlen, long off, long mlen)
+{
+    unsigned char *token = op++;
+    long ml = mlen - LZ_MINMATCH;
+
+    if (token >= oend) return NULL;
+    *token = (litlen < 15 ? litlen : 15) << 4;
+    if (litlen >= 15 && (op = lzLength(op, oend, litlen - 15)) == NULL)
+	return NULL;
+    if (oend - op < litlen) return NULL;
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (off == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = off;
+    *op++ = off >> 8;
+    *token |= ml < 15 ? ml : 15;
+    if (ml >= 15 && (op = lzLength(op, oend, ml - 15)) == NULL)
+	return NULL;
+    return op;
+}
+
+/**
+ * Compress n bytes from src into dst. Returns the compressed size,
+ * or 0 if it would be more than cap.
+ */
+static long
+lzCompress(const unsigned char *src, long n, unsigned char *dst, long cap)
+{
+    static uint32_t table[1 << LZ_HASHBITS];
+    const unsigned char *ip = src, *anchor = src;
+    const unsigned char *limit = src + n - LZ_MINMATCH;
+    unsigned char *op = dst, *oend = dst + cap;
+    int misses = 0;
+
+    memset(table, 0xff, sizeof(table));
+    while (ip < limit) {
+	uint32_t seq = lzRead32(ip);
+	uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASHBITS);
+	uint32_t cand = table[h];
+	const unsigned char *ref = src + cand;
+	long mlen;
+
+	table[h] = ip - src;
+	if (cand == UINT32_MAX || ip - ref > LZ_MAXOFF ||
+	    lzRead32(ref) != seq)
+	{
+	    /* Skip faster through data that doesn't compress */
+	    ip += 1 + (misses++ >> 6);
+	    continue;
+	}
+	misses = 0;
+	for (mlen = LZ_MINMATCH; ip + mlen + 8 <= src + n &&
+	     memcmp(ip + mlen, ref + mlen, 8) == 0;)
+	{
+	    mlen += 8;
+	}
+	while (ip + mlen < src + n && ip[mlen] == ref[mlen])
+	    ++mlen;
+	op = lzSequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+	if (op == NULL) return 0;
+	ip += mlen;
+	anchor = ip;
+    }
+    op = lzSequence(op, oend, anchor, src + n - anchor, 0, 0);
+    return op != NULL ? op - dst : 0;
+}
+
+/**
+ * Decompress n bytes from src into dst, which holds cap bytes.
+ * Returns the decompressed size, or -1 if the data is bad.
+ */
+static long
+lzDecompress(const unsigned char *src, long n, unsigned char *dst, long cap)
+{
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+	int token = *ip++;
+	long len = token >> 4, off;
+	unsigned char *ref;
+
+	if (len == 15) {
+	    do {
+		if (ip >= iend) return -1;
+		len += *ip;
+	    } while (*ip++ == 255);
+	}
+	if (iend - ip < len || oend - op < len) return -1;
+	memcpy(op, ip, len);
+	ip += len;
+	op += len;
+	if (ip == iend) break;
+
+	if (iend - ip < 2) return -1;
+	off = ip[0] | ip[1] << 8;
+	ip += 2;
+	len = (token & 15) + LZ_MINMATCH;
+	if ((token & 15) == 15) {
+	    do {
+		if (ip >= iend) return -1;
+		len += *ip;
+	    } while (*ip++ == 255);
+	}
+	if (off == 0 || off > op - dst || oend - op < len) return -1;
+	ref = op - off;
+	if (off >= len) {
+	    memcpy(op, ref, len);
+	    op += len;
+	} else {
+	    while (len-- > 0)
+		*op++ = *ref++;
+	}
+    }
+    return op - dst;
+}
+
+
+#pragma mark -- LogBuffer management --
+
+/**
+ * Create one circular buffer for holding logs
+ * @param pat - string, which when seen in a log message, causes it
+ * to be added to this buffer
+ * @param type - single character name for this buffer, e.g. 'D', 'I', 'W', 'E'
+ * @param limit — max buffer size in MB
+ *
+ * If 'pat' is NULL, then all log messages match.
+ *
+ * The 'type' value may be any character, but 'D', 'I', 'W', 'E' are
+ * special when combined with colorization.
+ */
+LogBuffer *
+LogBufferAlloc(const char *pat, char type, long limit)
+{
+    LogBuffer *lb = malloc(sizeof(*lb));
+    if (lb == NULL) return lb;
+    if (limit < 1000)
+	limit = limit > 0 ? limit * 1024*1024 : 1000;
+    limit &= ~(MSG_ALIGN-1);
+    /* Under a budget, that's the minimum, and the arena can grow to
+     * the whole budget. Pages are only touched as they're used.
+     */
+    lb->min = limit;
+    lb->priority = 0;
+    if (membudget > limit)
+	limit = membudget & ~(MSG_ALIGN-1);
+    lb->allocated = 0;
+    lb->ckpt = NULL;
+    if ((lb->unpack = calloc(1, sizeof(Buf))) == NULL ||
+	(lb->ckpt = malloc(CKPT_SLOTS * sizeof(Ckpt))) == NULL ||
+	(lb->arena = malloc(limit)) == NULL)
+    {
+	free(lb->ckpt);
+	free(lb->unpack);
+	free(lb);
+	return NULL;
+    }
+    /* If this fails, dumps just won't run in the background */
+    lb->spare = malloc(limit);
+    lb->ring = NULL;
+    lb->region = 0;
+    lb->child = 0;
+    lb->classified = lb->evicted = 0;
+    lb->limit = limit;
+    lb->pat = pat;
+    lb->type = type;
+    LogBufferInit(lb);
+    return lb;
+}
+
+/**
+ * Add this log buffer to the list.
+ *
+ * Log messages are matched against logbuffer patterns in the order
+ * in which they were added until a match is found, a logbuffer with
+ * a NULL pattern is found, or the end of the list is reached, in
+ * which case the message will go into the last buffer.
+ */
+void
+LogBufferAdd(LogBuffer *lb)
+{
+    if (nLogBuffer >= maxLogBuffer) {
+	int max = maxLogBuffer > 0 ? maxLogBuffer * 2 : 8;
+	LogBuffer **tmp = realloc(logbuffers, max * sizeof(*tmp));
+	if (tmp == NULL) {
+	    fprintf(stderr, "Out of memory, log buffer ignored\n");
+	    return;
+	}
+	logbuffers = tmp;
+	maxLogBuffer = max;
+    }
+    LogBufferInit(lb);
+    if (persistdir != NULL && lbPersist(lb, nLogBuffer) < 0) {
+	fprintf(stderr, "Unable to create persistent ring, log buffer ignored\n");
+	return;
+    }
+    logbuffers[nLogBuffer++] = lb;
+    matchInvalidate();
+}
+
+/**
+ * Set this buffer's priority for space beyond its minimum, when
+ * membudget is set. Higher priorities take space from lower ones.
+ */
+void
+LogBufferPriority(LogBuffer *lb, int priority)
+{
+    lb->priority = priority;
+}
+
+static void
+LogBufferInit(LogBuffer *lb)
+{
+    lb->head = lb->tail = 0;
+    lb->wrap = lb->limit;
+    lb->nmsgs = 0;
+    budgetUsed -= lb->allocated;
+    lb->allocated = 0;
+    lb->blockN = 0;
+    lb->last = lb->repeat = -1;
+    lb->iterLeft = 0;
+    lb->entries = 0;
+    lb->ckptFirst = lb->nckpt = 0;
+    lb->ckptBytes = 0;
+}
+
+/**
+ * Add one line to this logbuffer
+ */
+void
+LogBufferAppend(LogBuffer *lb, long seq, const char *line, short fd)
+{
+    LogBufferAppendLen(lb, seq, line, strlen(line), fd);
+}
+
+/**
+ * Add one line of known length to this logbuffer
+ */
+void
+LogBufferAppendLen(LogBuffer *lb, long seq, const char *line, size_t len,
+    short fd)
+{
+    LogMsg *msg = lbAppend(lb, seq, line, len, fd);
+    msg->time = nowNs();
+    if (lb->ring != NULL) lbPublish(lb);
+}
+
+/**
+ * Store one message and return it. The caller fills in the time,
+ * thread and flags.
+ */
+static LogMsg *
+lbAppend(LogBuffer *lb, long seq, const char *line, size_t len, short fd)
+{
+    size_t maxlen = lb->limit - offsetof(LogMsg, line) - MSG_ALIGN;
+    char mark[TRUNC_ROOM];
+    size_t keep = len;
+    int m = 0;
+    LogMsg *msg;
+
+    /* A line that can't fit in the whole arena is truncated. The
+     * length is settled first, so the message's size always matches
+     * what was reserved for it.
+     */
+    if (len > maxlen) {
+	keep = maxlen - TRUNC_ROOM;
+	m = snprintf(mark, sizeof(mark), TRUNC_MARK, (long long)(len - keep));
+	len = keep + m;
+    }
+
+    msg = lbReserve(lb, MSGSIZE(len));
+    lb->last = (char *)msg - lb->arena;
+    lb->repeat = -1;
+    msg->seq = seq;
+    msg->time = 0;
+    msg->linelen = len;
+    msg->fd = fd;
+    msg->type = lb->type;
+    msg->tid = 0;
+    msg->flags = 0;
+    msg->child = 0;
+    memcpy(msg->line, line, keep);
+    memcpy(msg->line + keep, mark, m);
+    msg->line[len] = '\0';
+    return msg;
+}
+
+/**
+ * If this line is the same as the newest one in the buffer, count it
+ * in the MSG_REPEAT message that follows that one, and return the
+ * MSG_REPEAT message. The caller sets its time and seq to those of
+ * this repeat. Otherwise, or if the line had to be evicted to make
+ * room for the count, returns NULL.
+ */
+static LogMsg *
+lbRepeat(LogBuffer *lb, const char *line, size_t len, short fd, int tid,
+    int flags)
+{
+    LogMsg *last, *msg;
+    long count = 1;
+
+    if (lb->last < 0) return NULL;
+    last = (LogMsg *)(lb->arena + lb->last);
+    if ((size_t)last->linelen != len || last->fd != fd || last->tid != tid ||
+	last->child != lineChild || last->flags != flags ||
+	memcmp(last->line, line, len) != 0)
+    {
+	return NULL;
+    }
+
+    if (lb->repeat >= 0) {
+	msg = (LogMsg *)(lb->arena + lb->repeat);
+	memcpy(&count, msg->line, sizeof(count));
+	++count;
+	memcpy(msg->line, &count, sizeof(count));
+	return msg;
+    }
+
+    /* This may compress the line, in which case the next repeat
+     * starts over. It may also evict it, and since it's the newest,
+     * everything else; then the count would follow nothing, so the
+     * line is stored again instead.
+     */
+    msg = lbReserve(lb, MSGSIZE(sizeof(count)));
+    if (lb->nmsgs == 1) {
+	LogBufferInit(lb);
+	return NULL;
+    }
+    if (lb->last >= 0)
+	lb->repeat = (char *)msg - lb->arena;
+    msg->seq = 0;
+    msg->linelen = sizeof(count);
+    msg->fd = fd;
+    msg->type = lb->type;
+    msg->tid = tid;
+    msg->child = lineChild;
+    msg->flags = MSG_REPEAT;
+    memcpy(msg->line, &count, sizeof(count));
+    msg->line[sizeof(count)] = '\0';
+    return msg;
+}
+
+/**
+ * Make room for a message of 'size' bytes at the tail of the arena,
+ * evicting the oldest messages as needed. Returns the new message,
+ * which is already counted in the buffer.
+ */
+static LogMsg *
+lbReserve(LogBuffer *lb, long size)
+{
+    LogMsg *msg;
+    bool moved = false;
+
+    if (lb->blockN > 0 && lb->tail - lb->blockStart >= blocksize)
+	lbSeal(lb);
+    if (membudget > 0 && budgetUsed + size > membudget)
+	budgetReclaim(lb, size);
+    for (;;) {
+	if (lb->nmsgs == 0) {
+	    LogBufferInit(lb);
+	}
+	if (lb->nmsgs > 0 && lb->tail <= lb->head) {
+	    /* Wrapped; free space is [tail, head) */
+	    if (lb->head - lb->tail >= size) break;
+	    lbEvict(lb);
+	} else {
+	    /* Free space is [tail, limit), then [0, head) after wrapping */
+	    if (lb->limit - lb->tail >= size) break;
+	    if (lb->blockN > 0) {
+		/* Blocks don't wrap; this one may free enough space */
+		lbSeal(lb);
+		continue;
+	    }
+	    lb->wrap = lb->tail;
+	    lb->tail = 0;
+	}
+	moved = true;
+    }
+    /* The ring file mustn't claim messages we're about to overwrite */
+    if (moved && lb->ring != NULL) lbPublish(lb);
+    msg = (LogMsg *)(lb->arena + lb->tail);
+    if (blocksize == 0)
+	lbCheckpoint(lb, lb->tail, lb->entries, size);
+    else if (lb->blockN++ == 0)
+	lb->blockStart = lb->tail;
+    lb->tail += size;
+    lb->entries++;
+    lb->nmsgs++;
+    lb->allocated += size;
+    budgetUsed += size;
+    return msg;
+}
+
+/**
+ * Discard the oldest message
+ */
+static void
+lbEvict(LogBuffer *lb)
+{
+    LogMsg *msg = (LogMsg *)(lb->arena + lb->head);
+    long size = MSGSIZE(msg->linelen);
+    /* A block's tid is its message count */
+    lb->evicted += (msg->flags & MSG_BLOCK) ? msg->tid : 1;
+    if (lb->blockN > 0 && lb->head == lb->blockStart) {
+	lb->blockStart += size;
+	--lb->blockN;
+    }
+    if (lb->head == lb->last)
+	lb->last = lb->repeat = -1;
+    if (lb->ckptFirst < lb->nckpt && lb->ckpt[lb->ckptFirst].off == lb->head)
+	++lb->ckptFirst;
+    lb->head += size;
+    lb->allocated -= size;
+    budgetUsed -= size;
+    if (lb->head >= lb->wrap) {
+	lb->head = 0;
+	lb->wrap = lb->limit;
+    }
+    if (--lb->nmsgs == 0) {
+	LogBufferInit(lb);
+    }
+}
+
+/**
+ * Empty a log buffer. The arena is kept for reuse.
+ */
+void
+LogBufferClear(LogBuffer *lb)
+{
+    LogBufferInit(lb);
+    if (lb->ring != NULL) lbPublish(lb);
+}
+
+/**
+ * Compress the messages in [blockStart, tail) into one MSG_BLOCK
+ * message written over them. If that doesn't save space, they're
+ * left as they are.
+ */
+static void
+lbSeal(LogBuffer *lb)
+{
+    static Buf packed;
+    long rawlen = lb->tail - lb->blockStart;
+    LogMsg *first = (LogMsg *)(lb->arena + lb->blockStart);
+    LogMsg block;
+    long clen, size;
+    uint32_t ulen = rawlen;
+
+    packed.len = 0;
+    if (!bufGrow(&packed, rawlen)) goto raw;
+    clen = lzCompress((unsigned char *)first, rawlen,
+		      (unsigned char *)packed.buf, rawlen);
+    size = MSGSIZE(sizeof(ulen) + clen);
+    if (clen == 0 || size >= rawlen) goto raw;
+
+    block = *first;
+    block.linelen = sizeof(ulen) + clen;
+    block.fd = -1;
+    block.tid = lb->blockN;
+    block.flags = MSG_BLOCK;
+
+    /* Don't let the ring file claim messages while they're overwritten */
+    lb->tail = lb->blockStart;
+    lb->nmsgs -= lb->blockN;
+    lb->entries -= lb->blockN;
+    lb->allocated -= rawlen;
+    budgetUsed -= rawlen;
+    if (lb->ring != NULL) lbPublish(lb);
+
+    memcpy(first, &block, offsetof(LogMsg, line));
+    memcpy(first->line, &ulen, sizeof(ulen));
+    memcpy(first->line + sizeof(ulen), packed.buf, clen);
+    first->line[block.linelen] = '\0';
+    lb->tail += size;
+    lb->nmsgs++;
+    lb->allocated += size;
+    budgetUsed += size;
+    if (lb->ring != NULL) lbPublish(lb);
+    lbCheckpoint(lb, lb->blockStart, lb->entries++, size);
+    lb->last = lb->repeat = -1;
+    lb->blockN = 0;
+    return;
+
+raw:
+    /* The messages stay as they are, and won't move now */
+    lbCheckpoint(lb, lb->blockStart, lb->entries - lb->blockN, rawlen);
+    lb->blockN = 0;
+}
+
+/**
+ * Consider the message at 'off', which had 'n' messages before it,
+ * as a checkpoint. 'size' is how much it and any messages skipped
+ * since the last call take up.
+ */
+static void
+lbCheckpoint(LogBuffer *lb, long off, long n, long size)
+{
+    Ckpt *c;
+
+    if (lb->ckpt == NULL || (lb->ckptBytes += size) < lb->limit / CKPT_MAX)
+	return;
+    lb->ckptBytes = 0;
+    if (lb->nckpt == CKPT_SLOTS) {
+	/* Evicted checkpoints are at the front */
+	lb->nckpt -= lb->ckptFirst;
+	memmove(lb->ckpt, lb->ckpt + lb->ckptFirst, lb->nckpt * sizeof(*c));
+	lb->ckptFirst = 0;
+	if (lb->nckpt == CKPT_SLOTS) return;
+    }
+    c = &lb->ckpt[lb->nckpt++];
+    c->off = off;
+    c->n = n;
+}
+
+/**
+ * Set up to iterate
+ */
+static void
+LogBufferIterator(LogBuffer *lb)
+{
+    /* Iteration walks the arena from head, wrapping at 'wrap',
+     * until all messages have been seen.
+     */
+    lb->iter = lb->head;
+    lb->iterLeft = lb->nmsgs;
+    if (lb->unpack != NULL)
+	lb->unpack->len = lb->unpackPos = 0;
+}
+
+/**
+ * Set up to iterate, skipping to the last checkpoint before 'since'
+ * (in ns). Messages are stored in time order, so nothing before the
+ * checkpoint can be wanted.
+ */
+static void
+lbIterFrom(LogBuffer *lb, int64_t since)
+{
+    int lo = lb->ckptFirst, hi = lb->nckpt;
+
+    LogBufferIterator(lb);
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	LogMsg *msg = (LogMsg *)(lb->arena + lb->ckpt[mid].off);
+	if (msg->time < since)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo > lb->ckptFirst) {
+	lb->iter = lb->ckpt[lo-1].off;
+	lb->iterLeft = lb->entries - lb->ckpt[lo-1].n;
+    }
+}
+
+/**
+ * Return the next message in the arena, or NULL if exhausted.
+ * Blocks are returned as they are.
+ */
+static LogMsg *
+lbEntryNext(LogBuffer *lb)
+{
+    LogMsg *msg;
+    if (lb->iterLeft <= 0) return NULL;
+    msg = (LogMsg *)(lb->arena + lb->iter);
+    lb->iter += MSGSIZE(msg->linelen);
+    if (lb->iter >= lb->wrap) lb->iter = 0;
+    --lb->iterLeft;
+    return msg;
+}
+
+/**
+ * Return next logmessage, or NULL if exhausted. Blocks are
+ * decompressed as they're reached, and the messages in them are
+ * valid until the next call.
+ */
+static LogMsg *
+LogBufferNext(LogBuffer *lb)
+{
+    Buf *u = lb->unpack;
+    LogMsg *msg;
+    uint32_t ulen;
+
+    for (;;) {
+	if (u != NULL && lb->unpackPos < u->len) {
+	    msg = (LogMsg *)(u->buf + lb->unpackPos);
+	    /* Blocks from a ring file may be damaged */
+	    if (lb->unpackPos + offsetof(LogMsg, line) > u->len ||
+		msg->linelen < 0 ||
+		lb->unpackPos + MSGSIZE(msg->linelen) > u->len)
+	    {
+		u->len = 0;
+		continue;
+	    }
+	    lb->unpackPos += MSGSIZE(msg->linelen);
+	    return msg;
+	}
+	if ((msg = lbEntryNext(lb)) == NULL || !(msg->flags & MSG_BLOCK))
+	    return msg;
+	if (u == NULL || msg->linelen < (int)sizeof(ulen))
+	    continue;
+	memcpy(&ulen, msg->line, sizeof(ulen));
+	u->len = lb->unpackPos = 0;
+	if (ulen > lb->limit * 64 || !bufGrow(u, ulen))
+	    continue;
+	if (lzDecompress((unsigned char *)msg->line + sizeof(ulen),
+			 msg->linelen - sizeof(ulen),
+			 (unsigned char *)u->buf, ulen) != ulen)
+	{
+	    continue;
+	}
+	u->len = ulen;
+    }
+}
+
+#if 0
+static void
+LogBufferDump(LogBuffer *lb)
+{
+    LogMsg *msg;
+    for (msg = lb->first; msg != NULL; msg = msg->next) {
+	printf("%ld %c %s %s\n",
+	  msg->seq, msg->type, timeStr(msg->time), msg->line);
+    }
+}
+
+static void
+LogBufferIterate(LogBuffer *lb)
+{
+    LogMsg *msg;
+    lbIterator(lb);
+    while ((msg = lbNext(lb)) != NULL) {
+	printf("%ld %c %s %s\n",
+	  msg->seq, msg->type, timeStr(msg->time), msg->line);
+    }
+}
+#endif
+
+#pragma mark -- Memory budget --
+
+/*
+ * With membudget set, the buffers share that much memory between
+ * them instead of each having a fixed size. Each buffer is promised
+ * its own minimum; space beyond that goes to whichever buffer is
+ * busy, and is taken back when a buffer that outranks it, or one
+ * still under its minimum, needs room. Every arena is sized to the
+ * whole budget, but only the pages in use are touched. Pages freed
+ * by eviction, whether to make room for another buffer or for the
+ * buffer's own newer messages, are returned to the system, or a
+ * buffer's tail going round its arena would touch all of it; so are
+ * a spare's, once a dump is done with it. It can't be combined with
+ * persistdir, whose ring files would each take twice the budget.
+ */
+
+/**
+ * Return the buffer that 'lb' should take space from, or NULL if it
+ * should evict its own messages.
+ */
+static LogBuffer *
+budgetVictim(LogBuffer *lb, long size)
+{
+    bool underMin = lb->allocated + size <= lb->min;
+    LogBuffer *victim = NULL;
+    int i;
+
+    for (i=0; i<nLogBuffer; ++i) {
+	LogBuffer *v = logbuffers[i];
+	if (v == lb || v->nmsgs == 0 || v->allocated <= v->min)
+	    continue;
+	if (!underMin && v->priority >= lb->priority)
+	    continue;
+	if (victim == NULL || v->priority < victim->priority ||
+	    (v->priority == victim->priority &&
+	     v->allocated - v->min > victim->allocated - victim->min))
+	{
+	    victim = v;
+	}
+    }
+    return victim;
+}
+
+/**
+ * Evict at least 'want' bytes of v's oldest messages, keeping 'min',
+ * and release the pages they were in. Returns the bytes freed.
+ */
+static long
+budgetShrink(LogBuffer *v, long want, long min)
+{
+    long before = v->allocated;
+
+    while (v->nmsgs > 0 && before - v->allocated < want &&
+	   v->allocated > min)
+    {
+	lbEvict(v);
+    }
+    lbRelease(v);
+    return before - v->allocated;
+}
+
+/**
+ * Free enough of the budget for 'lb' to store 'size' more bytes.
+ * Space is taken in chunks, from other buffers or lb itself, so this
+ * isn't done for every line.
+ */
+static void
+budgetReclaim(LogBuffer *lb, long size)
+{
+    long chunk = membudget / 64;
+
+    while (budgetUsed + size > membudget)
+    {
+	LogBuffer *v = budgetVictim(lb, size);
+	long want = budgetUsed + size - membudget;
+
+	if (want < chunk) want = chunk;
+	if (v == NULL) {
+	    /* Nobody owes lb anything; if even its minimum won't fit,
+	     * the minimums add up to more than the budget.
+	     */
+	    if (lb->nmsgs == 0 || lb->allocated + size <= lb->min)
+		return;
+	    budgetShrink(lb, want, 0);
+	    continue;
+	}
+	++stats.reclaims;
+	stats.reclaimBytes += budgetShrink(v, want, v->min);
+    }
+}
+
+/**
+ * Give the pages in [ptr, ptr+len) back to the system. Only whole
+ * pages are released; the memory reads as zeros, or as it was, until
+ * it's written again.
+ */
+static void
+pagesRelease(char *ptr, long len)
+{
+    static long pagesize;
+    uintptr_t start, end;
+
+    if (pagesize == 0) pagesize = sysconf(_SC_PAGESIZE);
+    start = ((uintptr_t)ptr + pagesize - 1) & ~(uintptr_t)(pagesize - 1);
+    end = ((uintptr_t)ptr + len) & ~(uintptr_t)(pagesize - 1);
+    if (end <= start) return;
+#ifdef LINUX
+    madvise((void *)start, end - start, MADV_DONTNEED);
+#else
+    madvise((void *)start, end - start, MADV_FREE);
+#endif
+}
+
+/**
+ * Release the free space in a buffer's arena.
+ */
+static void
+lbRelease(LogBuffer *lb)
+{
+    if (lb->nmsgs == 0) {
+	pagesRelease(lb->arena, lb->limit);
+    } else if (lb->tail <= lb->head) {
+	pagesRelease(lb->arena + lb->tail, lb->head - lb->tail);
+	pagesRelease(lb->arena + lb->wrap, lb->limit - lb->wrap);
+    } else {
+	pagesRelease(lb->arena + lb->tail, lb->limit - lb->tail);
+	pagesRelease(lb->arena, lb->head);
+    }
+}
+
+#pragma mark -- Persistent rings --
+
+/*
+ * With persistdir set, each LogBuffer's arena and its spare live in a
+ * memory-mapped file, so the logs survive superlog itself being
+ * killed. The file is a header page followed by the two arenas.
+ *
+ * The header holds two copies of the buffer state. A change is made
+ * to the copy not in use, then 'cur' is flipped to it, so the state
+ * read back is always consistent. The state is published after a
+ * message is complete, and before space from evicted messages is
+ * reused. 'dumpedSeq' is the last seq written out by LogDump();
+ * LogRecover() shows only what came after.
+ */
+
+#define RING_MAGIC      0x53526e67      /* "SRng" */
+#define RING_VERSION    3
+#define RING_HDR        4096
+
+typedef struct {
+    long head, tail, wrap, nmsgs, allocated;
+} ArenaState;
+
+typedef struct {
+    ArenaState arena[2];
+    int active;         /* Arena being written; the other may hold a
+			 * dump in progress */
+} RingState;
+
+typedef struct RingHeader {
+    uint32_t magic;
+    uint32_t version;
+    long limit;         /* Size of each arena */
+    char type;
+    _Atomic int cur;    /* Which state[] is valid */
+    RingState state[2];
+    _Atomic long dumpedSeq;
+} RingHeader;
+
+/**
+ * Copy the buffer's state into the ring file header.
+ */
+static void
+lbPublish(LogBuffer *lb)
+{
+    RingHeader *h = lb->ring;
+    int cur = atomic_load_explicit(&h->cur, memory_order_relaxed);
+    RingState *s = &h->state[!cur];
+    ArenaState *a = &s->arena[lb->region];
+
+    *s = h->state[cur];
+    a->head = lb->head;
+    a->tail = lb->tail;
+    a->wrap = lb->wrap;
+    a->nmsgs = lb->nmsgs;
+    a->allocated = lb->allocated;
+    s->active = lb->region;
+    atomic_store_explicit(&h->cur, !cur, memory_order_release);
+}
+
+/**
+ * Mark the ring's other arena empty, before the spare is used for
+ * something other than a dump.
+ */
+static void
+lbSpareClear(LogBuffer *lb)
+{
+    RingHeader *h = lb->ring;
+    int cur = atomic_load_explicit(&h->cur, memory_order_relaxed);
+    RingState *s = &h->state[!cur];
+
+    *s = h->state[cur];
+    memset(&s->arena[!lb->region], 0, sizeof(ArenaState));
+    atomic_store_explicit(&h->cur, !cur, memory_order_release);
+}
+
+/**
+ * Note that everything up to seq in this buffer has been dumped.
+ */
+static void
+lbDumped(LogBuffer *lb, long seq)
+{
+    if (lb->ring != NULL)
+	atomic_store(&lb->ring->dumpedSeq, seq);
+}
+
+/**
+ * Move a buffer's storage into a new ring file in persistdir.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+lbPersist(LogBuffer *lb, int idx)
+{
+    char path[PATH_MAX];
+    size_t size = RING_HDR + 2 * lb->limit;
+    RingHeader *h;
+    int fd, i;
+
+    if (membudget > 0) {
+	fprintf(stderr, "persistdir can't be used with membudget\n");
+	return -1;
+    }
+    snprintf(path, sizeof(path), "%s/superlog.%d.ring", persistdir, idx);
+    if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) {
+	perror(path);
+	return -1;
+    }
+
+    /* Files past this one are from an earlier run with more buffers,
+     * and LogRecover() mustn't take them for this run's. Buffers are
+     * added in order, so once the last is added, none are left.
+     */
+    for (i = idx + 1; ; ++i) {
+	char stale[PATH_MAX];
+	snprintf(stale, sizeof(stale), "%s/superlog.%d.ring", persistdir, i);
+	if (unlink(stale) < 0)
+	    break;
+    }
+    if (ftruncate(fd, size) < 0) {
+	perror(path);
+	close(fd);
+	return -1;
+    }
+    h = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+	perror(path);
+	return -1;
+    }
+    h->limit = lb->limit;
+    h->type = lb->type;
+    h->version = RING_VERSION;
+    atomic_store(&h->cur, 0);
+    atomic_store(&h->dumpedSeq, 0);
+    h->magic = RING_MAGIC;
+
+    free(lb->arena);
+    free(lb->spare);
+    lb->arena = (char *)h + RING_HDR;
+    lb->spare = lb->arena + lb->limit;
+    lb->ring = h;
+    lb->region = 0;
+    LogBufferInit(lb);
+    lbPublish(lb);
+    return 0;
+}
+
+/**
+ * Set up a LogBuffer that reads one arena of a recovered ring. Any
+ * damaged messages at the end, and any already dumped, are dropped.
+ * Returns false if there's nothing to show.
+ */
+static bool
+ringArena(RingHeader *h, size_t size, int r, LogBuffer *lb)
+{
+    ArenaState *a = &h->state[atomic_load(&h->cur) & 1].arena[r];
+    long dumped = atomic_load(&h->dumpedSeq), prev = 0, n;
+    LogMsg *msg;
+
+    memset(lb, 0, sizeof(*lb));
+    lb->limit = h->limit;
+    lb->type = h->type;
+    lb->arena = (char *)h + RING_HDR + r * h->limit;
+    if (a->nmsgs <= 0 || a->head < 0 || a->head >= h->limit ||
+	a->wrap > h->limit || RING_HDR + 2 * h->limit > size)
+    {
+	return false;
+    }
+    lb->head = a->head;
+    lb->tail = a->tail;
+    lb->wrap = a->wrap;
+    lb->nmsgs = a->nmsgs;
+
+    /* Check every message, keeping those that make sense */
+    LogBufferIterator(lb);
+    for (n=0; n<a->nmsgs; ++n) {
+	long off = lb->iter;
+	msg = (LogMsg *)(lb->arena + off);
+	if (off + offsetof(LogMsg, line) > lb->limit || msg->linelen < 0 ||
+	    off + MSGSIZE(msg->linelen) > lb->limit ||
+	    msg->line[msg->linelen] != '\0' || msg->seq <= prev)
+	{
+	    break;
+	}
+	prev = msg->seq;
+	lbEntryNext(lb);
+    }
+    lb->nmsgs = n;
+
+    /* Skip what was already dumped */
+    LogBufferIterator(lb);
+    while (lb->nmsgs > 0 && (msg = lbEntryNext(lb))->seq <= dumped) {
+	lb->head = (char *)msg - lb->arena + MSGSIZE(msg->linelen);
+	if (lb->head >= lb->wrap) lb->head = 0;
+	--lb->nmsgs;
+    }
+    if (lb->nmsgs > 0 && (lb->unpack = calloc(1, sizeof(Buf))) == NULL)
+	return false;
+
+    /* Index what's left, for queries. Without it they just scan. */
+    if (lb->nmsgs > 0 &&
+	(lb->ckpt = malloc(CKPT_SLOTS * sizeof(Ckpt))) != NULL)
+    {
+	LogBufferIterator(lb);
+	for (n=0; (msg = lbEntryNext(lb)) != NULL; ++n)
+	    lbCheckpoint(lb, (char *)msg - lb->arena, n, MSGSIZE(msg->linelen));
+	lb->entries = n;
+    }
+    return lb->nmsgs > 0;
+}
+
+/**
+ * Read the ring files left in 'dir' by a superlog run with persistdir
+ * set, and write out the messages that were never dumped and pass
+ * filter q, if given, using the usual formatting options. The files
+ * aren't changed, so this can query a superlog that's still running.
+ * Returns 0 on success, else:
+ *      3 = system error
+ *      4 = unable to open output file
+ */
+int
+LogRecover(const char *dir, const char *ofilename, const LogFilter *q)
+{
+    LogBuffer *bufs = NULL;
+    DumpEnt *heap;
+    DIR *d;
+    struct dirent *de;
+    int nbufs = 0, maxbufs = 0, r;
+
+    ofile = stdout;
+    if (ofilename != NULL && (ofile = fopen(ofilename, "w")) == NULL) {
+	perror(ofilename);
+	return 4;
+    }
+    if ((d = opendir(dir)) == NULL) {
+	perror(dir);
+	return 3;
+    }
+    while ((de = readdir(d)) != NULL) {
+	char path[PATH_MAX];
+	size_t len = strlen(de->d_name);
+	struct stat st;
+	RingHeader *h;
+	int fd;
+
+	if (len < 5 || strcmp(de->d_name + len - 5, ".ring") != 0)
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+	    perror(path);
+	    continue;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < RING_HDR) {
+	    close(fd);
+	    continue;
+	}
+	h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED)
+	    continue;
+	if (h->magic != RING_MAGIC || h->version != RING_VERSION) {
+	    fprintf(stderr, "%s: not a superlog ring\n", path);
+	    munmap(h, st.st_size);
+	    continue;
+	}
+	/* Read-only mapping, but the iterator lives in the LogBuffer */
+	for (r=0; r<2; ++r) {
+	    if (nbufs >= maxbufs) {
+		LogBuffer *tmp;
+		maxbufs = maxbufs > 0 ? maxbufs * 2 : 8;
+		if ((tmp = realloc(bufs, maxbufs * sizeof(*tmp))) == NULL) {
+		    fprintf(stderr, "Out of memory\n");
+		    return 3;
+		}
+		bufs = tmp;
+	    }
+	    if (ringArena(h, st.st_size, r, &bufs[nbufs]))
+		++nbufs;
+	}
+    }
+    closedir(d);
+
+    if ((heap = malloc((nbufs + 1) * sizeof(*heap))) == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	return 3;
+    }
+    dumpPosition(bufs, nbufs, q);
+    dumpWrite(bufs, nbufs, heap, nowNs(), q, ofile, NULL);
+    for (r=0; r<nbufs; ++r) {
+	free(bufs[r].unpack->buf);
+	free(bufs[r].unpack);
+	free(bufs[r].ckpt);
+    }
+    free(heap);
+    free(bufs);
+    return 0;
+}
+
+
+#pragma mark -- Exclusion patterns --
+
+static const char **excludePats = NULL;
+static int numExclude = 0;
+
+static void
+rstrip(char *buffer)
+{
+    size_t len = strlen(buffer);
+    if (len > 0 && buffer[len-1] == '\n')
+	buffer[len-1] = '\0';
+}
+
+/**
+ * Add this string to the exclusion patterns. If 'pat' is encountered
+ * in a log message, the message is discarded.
+ */
+void
+ExcludeAdd(const char *pat)
+{
+    const char **tmp = realloc(excludePats, (numExclude+1) * sizeof(*tmp));
+    if (tmp == NULL) {
+	fprintf(stderr, "Out of memory, exclude pattern \"%s\" ignored\n",
+	    pat);
+	return;
+    }
+    excludePats = tmp;
+    excludePats[numExclude++] = pat;
+    matchInvalidate();
+}
+
+/**
+ * Add strings from a file to the exclusion patterns
+ */
+void
+ExcludeAddFile(const char *filename)
+{
+    FILE *xfile = fopen(filename, "r");
+    char pat[1024];
+    if (xfile == NULL) {
+	perror(filename);
+	return;
+    }
+    while (fgets(pat, sizeof(pat), xfile) != NULL)
+    {
+	rstrip(pat);
+	ExcludeAdd(strdup(pat));
+    }
+    fclose(xfile);
+}
+
+/**
+ * Check this line against all patterns, return true if exlcuded.
+ */
+bool
+ExcludeTest(const char *line)
+{
+    LineMatch m;
+    if (numExclude <= 0) return false;
+    matchLine(line, strlen(line), &m);
+    return m.excluded;
+}
+
+
+#pragma mark -- Triggers --
+
+static int triggerCount, tcontext;
+/**
+ * Set the trigger parameters.
+ * @param count      Number of times the trigger has to be seen
+ * @param context    Number of log events recorded after the trigger
+ *
+ * Once the trigger is seen 'count' times, and then 'context' log
+ * events have been seen, the logs are dumped and then disabled.
+ *
+ * Once a trigger has occurred, you need to call this again to
+ * "re-arm" it.
+ */
+void
+TriggerParams(int count, int context)
+{
+    triggerCount = count;
+    tcontext = context;
+}
+
+/**
+ * Add a string to the trigger list.
+ */
+void
+TriggerAdd(const char *trigger)
+{
+    const char **tmp = realloc(triggers, (numTrigger+1) * sizeof(*tmp));
+    if (tmp == NULL) {
+	fprintf(stderr, "Out of memory, trigger \"%s\" ignored\n", trigger);
+	return;
+    }
+    triggers = tmp;
+    triggers[numTrigger++] = trigger;
+    matchInvalidate();
 }
 
-static const char *
-timeStr(time_t t)
+/**
+ * Check this line against all patterns, return matching trigger or NULL
+ * if no match.
+ */
+const char *
+TriggerTest(const char *line)
 {
-    static char buffer[30];
-    struct tm *tm = localtime(&t);
-    strftime(buffer, sizeof(buffer), "%F %T ", tm);
-    return buffer;
+    LineMatch m;
+    if (numTrigger <= 0) return NULL;
+    matchLine(line, strlen(line), &m);
+    return m.trigger < numTrigger ? triggers[m.trigger] : NULL;
+}
+
+/**
+ * Check this line against the trigger patterns. Counting matching
+ * triggers and executing the context countdown as appropriate. Return true if
+ * all conditions satisfied and it's time to dump the logs.
+ */
+bool
+TriggerCheck(const char *str)
+{
+    if (numTrigger <= 0) return false;
+    return triggerCheckMatch(TriggerTest(str));
+}
+
+/**
+ * Guts of TriggerCheck(), for when the line has already been
+ * matched. 'match' is the trigger the line matched, or NULL.
+ */
+static bool
+triggerCheckMatch(const char *match)
+{
+    if (numTrigger <= 0) return false;
+    if (tcontext <= 0) return true;
+    if (triggerCount <= 0) return --tcontext <= 0;
+    if (match != NULL) {
+	fprintf(stderr, "log triggered, pattern \"%s\"\n", match);
+	--triggerCount;
+    }
+    return false;
 }
 
 
+#pragma mark -- Severity parsing --
 
-#pragma mark -- Logging --
+/*
+ * For logs in a known format, the severity can be read from the line
+ * rather than found by scanning it for patterns. The severity is
+ * reduced to one of 'D', 'I', 'W' or 'E', and the line goes into the
+ * first LogBuffer of that type, or the last one if there isn't one.
+ * Lines that can't be parsed are matched against the patterns as usual.
+ */
 
-static LogBuffer *logbuffers[MAX_BUFFERS];
-static int nLogBuffer = 0;
+/**
+ * Reduce a severity name, e.g. "warning", "ERR" or "I", to a type.
+ * Returns 0 if it's not recognized.
+ */
+static char
+sevType(int c)
+{
+    switch (toupper(c)) {
+    case 'D': case 'T':                         /* debug, trace */
+	return 'D';
+    case 'I': case 'N':                         /* info, notice */
+	return 'I';
+    case 'W':
+	return 'W';
+    case 'E': case 'F': case 'C': case 'A': case 'P':
+	return 'E';     /* error, fatal, critical, alert, panic, emerg */
+    }
+    return 0;
+}
 
-#if 0
-void
-AddToLog(const char *line, int fd, long seq, char type)
+/* glog: "Lmmdd hh:mm:ss.uuuuuu ...", where L is one of IWEF */
+static char
+sevGlog(const char *line, size_t len)
 {
     int i;
-    if (nLogBuffer <= 0) return;
+    if (len < 5 || strchr("IWEF", line[0]) == NULL) return 0;
+    for (i=1; i<5; ++i)
+	if (!isdigit((unsigned char)line[i])) return 0;
+    return sevType(line[0]);
+}
 
-    for (i=0; i<nLogBuffer; ++i)
-	if (logbuffers[i]->type == type) {
-	    LogBufferAppend(logbuffers[i], seq, line, fd, type);
-	    return;
-	}
-    /* No match, use the last one as the "catch-all" */
-    LogBufferAppend(logbuffers[nLogBuffer-1], seq, line, fd, type);
+/* syslog: "<PRI>...", where PRI is facility * 8 + severity */
+static char
+sevSyslog(const char *line, size_t len)
+{
+    static const char types[] = "EEEEWIID";
+    size_t i;
+    int pri = 0;
+
+    if (len < 3 || line[0] != '<') return 0;
+    for (i=1; i<len && i<5 && isdigit((unsigned char)line[i]); ++i)
+	pri = pri * 10 + line[i] - '0';
+    if (i == 1 || i >= len || line[i] != '>') return 0;
+    return types[pri & 7];
 }
-#endif
 
-static inline bool
-haveMsg(LogMsg **msgs, int n)
+/**
+ * Skip a JSON string starting at the quote at p. Returns the position
+ * after the closing quote, or NULL if the string doesn't end.
+ */
+static const char *
+jsonString(const char *p, const char *end)
 {
-    for (;--n >= 0; ++msgs)
-	if (*msgs != NULL) return true;
-    return false;
+    for (++p; p < end; ++p) {
+	if (*p == '\\') ++p;
+	else if (*p == '"') return p + 1;
+    }
+    return NULL;
+}
+
+static const char *
+jsonSpace(const char *p, const char *end)
+{
+    while (p < end && isspace((unsigned char)*p)) ++p;
+    return p;
+}
+
+/**
+ * Skip a JSON value. Nested objects and arrays are skipped by
+ * counting brackets outside strings.
+ */
+static const char *
+jsonValue(const char *p, const char *end)
+{
+    int depth = 0;
+
+    for (; p < end; ++p) {
+	switch (*p) {
+	case '"':
+	    if ((p = jsonString(p, end)) == NULL) return NULL;
+	    if (depth == 0) return p;
+	    --p;
+	    break;
+	case '{': case '[':
+	    ++depth;
+	    break;
+	case '}': case ']':
+	    if (depth == 0) return p;
+	    if (--depth == 0) return p + 1;
+	    break;
+	case ',':
+	    if (depth == 0) return p;
+	    break;
+	}
+    }
+    return NULL;
 }
 
-static inline int
-oldestMsg(LogMsg **msgs, int n)
+/* JSON: the first letter of the string value of sevkey in the
+ * top-level object.
+ */
+static char
+sevJson(const char *line, size_t len)
 {
-    long seq = 0;
-    int i, oldest = -1;
-    for (i=0; i<n; ++i, ++msgs) {
-	if (*msgs != NULL && (oldest < 0 || (*msgs)->seq < seq))
-	    oldest = i;
+    const char *p = line, *end = line + len, *key;
+    size_t klen = strlen(sevkey);
+    bool found;
+
+    p = jsonSpace(p, end);
+    if (p >= end || *p++ != '{') return 0;
+    for (;;) {
+	p = jsonSpace(p, end);
+	if (p >= end || *p != '"') return 0;
+	key = p + 1;
+	if ((p = jsonString(p, end)) == NULL) return 0;
+	found = (size_t)(p - 1 - key) == klen &&
+		memcmp(key, sevkey, klen) == 0;
+	p = jsonSpace(p, end);
+	if (p >= end || *p++ != ':') return 0;
+	p = jsonSpace(p, end);
+	if (found)
+	    return p + 1 < end && *p == '"' ? sevType(p[1]) : 0;
+	if ((p = jsonValue(p, end)) == NULL) return 0;
+	p = jsonSpace(p, end);
+	if (p >= end || *p++ != ',') return 0;
     }
-    return oldest;
 }
 
 /**
- * Dump logs and clear them
- * Log collection continues. Normally called from LogParent() when
- * the child exits, a trigger string is seen in the logs, or SIGUSR1 received.
+ * Classify the line by its severity field. Returns false if it
+ * doesn't have one.
  */
-void
-LogDump()
+static bool
+sevMatch(const char *line, size_t len, LineMatch *m)
 {
-    /* Go through each buffer, selecting the oldest entry from each,
-     * until they're all exhausted.
-     */
-    LogMsg *msgs[MAX_BUFFERS];
+    char type = 0;
     int i;
 
-    fprintf(ofile, "\nLog dump at %s\n\n", timeStr(time(NULL)));
+    switch (sevparse) {
+    case SEV_COLUMN:
+	if ((size_t)sevcolumn < len) type = sevType(line[sevcolumn]);
+	break;
+    case SEV_GLOG:
+	type = sevGlog(line, len);
+	break;
+    case SEV_SYSLOG:
+	type = sevSyslog(line, len);
+	break;
+    case SEV_JSON:
+	type = sevJson(line, len);
+	break;
+    default:
+	break;
+    }
+    if (type == 0) return false;
 
+    /* Exclusions and triggers still need the whole line */
+    if (numExclude > 0 || numTrigger > 0) {
+	matchLine(line, len, m);
+    } else {
+	m->trigger = INT_MAX;
+	m->excluded = false;
+    }
+    m->buffer = nLogBuffer - 1;
     for (i=0; i<nLogBuffer; ++i) {
-	LogBufferIterator(logbuffers[i]);
-	msgs[i] = LogBufferNext(logbuffers[i]);
+	if (logbuffers[i]->type == type) {
+	    m->buffer = i;
+	    break;
+	}
+    }
+    return true;
+}
+
+
+#pragma mark -- Pattern matching --
+
+/* Regex NFA, see "Regular expressions" */
+typedef struct {
+    char op;
+    int out, out1;              /* Next node(s) */
+    unsigned char set[32];      /* RX_CHAR: bytes that match */
+    LineMatch result;           /* RX_MATCH: what a match means */
+} RxNode;
+
+static struct {
+    RxNode *nodes;
+    int nnodes, maxnodes;
+    int start;                  /* Entry to the NFA, or -1 if no regexes */
+    unsigned gen;               /* Bumped whenever the NFA is rebuilt */
+    int nclass;                 /* Bytes no regex tells apart share a class */
+    unsigned char cls[256];
+    unsigned char rep[256];     /* A byte from each class */
+} rx = {.start = -1};
+
+/*
+ * All of the string patterns (LogBuffer patterns, exclusions and
+ * triggers) are compiled into a single Aho-Corasick automaton, so each
+ * line is scanned exactly once no matter how many patterns there are. The
+ * automaton is a full DFA over a compressed alphabet: bytes that
+ * appear in no pattern all share class 0. Each state carries the
+ * merged results of every pattern ending there, including the ones
+ * reached through failure links.
+ *
+ * The automaton is rebuilt lazily the first time a line is matched
+ * after a pattern has been added. Regex patterns are handled separately;
+ * see below.
+ */
+
+static struct {
+    bool valid;			/* Automaton is up to date */
+    int nclass;			/* Size of the compressed alphabet */
+    unsigned char cls[256];	/* Byte -> alphabet class */
+    int nstates;
+    int *delta;			/* nstates x nclass transition table */
+    LineMatch *out;		/* Per-state results */
+    bool *final;		/* State has a result */
+    LineMatch always;		/* Result for every line */
+} ac;
+
+static void
+matchInvalidate()
+{
+    ac.valid = false;
+    ++matchGen;
+}
+
+static inline void
+matchMerge(LineMatch *m, const LineMatch *o)
+{
+    if (o->buffer < m->buffer) m->buffer = o->buffer;
+    if (o->trigger < m->trigger) m->trigger = o->trigger;
+    m->excluded |= o->excluded;
+}
+
+/**
+ * Assign alphabet classes to the bytes of this pattern.
+ */
+static void
+acMark(const char *pat, int *nclass, size_t *total)
+{
+    const unsigned char *p = (const unsigned char *)pat;
+    if (pat == NULL || rxIs(pat)) return;
+    for (; *p != '\0'; ++p) {
+	if (ac.cls[*p] == 0) ac.cls[*p] = (*nclass)++;
+	++*total;
+    }
+}
+
+/**
+ * Add one pattern to the trie. NULL or empty patterns match every line,
+ * just as strstr() would.
+ */
+static void
+acInsert(const char *pat, const LineMatch *result)
+{
+    const unsigned char *p = (const unsigned char *)pat;
+    int s = 0, *t;
+
+    if (pat == NULL || *pat == '\0') {
+	matchMerge(&ac.always, result);
+	return;
+    }
+    for (; *p != '\0'; ++p) {
+	t = &ac.delta[s * ac.nclass + ac.cls[*p]];
+	if (*t == 0) *t = ac.nstates++;
+	s = *t;
     }
+    matchMerge(&ac.out[s], result);
+    ac.final[s] = true;
+}
+
+/**
+ * Add one pattern, either to the trie or to the regexes.
+ */
+static void
+acAdd(const char *pat, const LineMatch *result)
+{
+    if (rxIs(pat))
+	rxAdd(pat, result);
+    else
+	acInsert(pat, result);
+}
+
+/**
+ * Compile all current patterns into the automaton.
+ */
+static void
+acBuild()
+{
+    static const LineMatch none = {INT_MAX, INT_MAX, false};
+    LineMatch r;
+    size_t total = 0, maxstates;
+    int nclass = 1, *queue, *fail, qhead, qtail, i, c;
+
+    free(ac.delta);
+    free(ac.out);
+    free(ac.final);
+    rxReset();
 
-    while (haveMsg(msgs, nLogBuffer))
+    /* Build the alphabet and size the tables */
+    memset(ac.cls, 0, sizeof(ac.cls));
+    for (i=0; i<nLogBuffer; ++i) acMark(logbuffers[i]->pat, &nclass, &total);
+    for (i=0; i<numExclude; ++i) acMark(excludePats[i], &nclass, &total);
+    for (i=0; i<numTrigger; ++i) acMark(triggers[i], &nclass, &total);
+    maxstates = total + 1;
+    ac.nclass = nclass;
+    ac.nstates = 1;
+    ac.delta = calloc(maxstates * nclass, sizeof(*ac.delta));
+    ac.out = malloc(maxstates * sizeof(*ac.out));
+    ac.final = calloc(maxstates, sizeof(*ac.final));
+    queue = malloc(maxstates * sizeof(*queue));
+    fail = calloc(maxstates, sizeof(*fail));
+    if (ac.delta == NULL || ac.out == NULL || ac.final == NULL ||
+	queue == NULL || fail == NULL)
     {
-	LogMsg *lm = NULL;
-	i = oldestMsg(msgs, nLogBuffer);
-	lm = msgs[i];
-	msgs[i] = LogBufferNext(logbuffers[i]);
-	fputs(colorStart(lm->type, lm->fd), ofile);
-	if (showfds) fprintf(ofile, "%d ", lm->fd);
-	if (timestamps) fputs(timeStr(lm->time), ofile);
-	fputs(lm->line, ofile);
-	fputs(colorStop(lm->type, lm->fd), ofile);
-	fputc('\n', ofile);
-    }
-    fflush(ofile);
+	fprintf(stderr, "Out of memory compiling patterns\n");
+	exit(3);
+    }
+    for (i=0; i<maxstates; ++i) ac.out[i] = none;
+
+    /* Lines that match nothing go into the last buffer */
+    ac.always = none;
+    ac.always.buffer = nLogBuffer > 0 ? nLogBuffer-1 : 0;
 
     for (i=0; i<nLogBuffer; ++i) {
-	LogBufferClear(logbuffers[i]);
+	r = none;
+	r.buffer = i;
+	acAdd(logbuffers[i]->pat, &r);
+    }
+    r = none;
+    r.excluded = true;
+    for (i=0; i<numExclude; ++i) acAdd(excludePats[i], &r);
+    for (i=0; i<numTrigger; ++i) {
+	r = none;
+	r.trigger = i;
+	acAdd(triggers[i], &r);
+    }
+
+    /* Breadth-first pass to compute failure links and turn the trie
+     * into a DFA. Children of the root fail back to the root.
+     */
+    qhead = qtail = 0;
+    for (c=0; c<nclass; ++c)
+	if (ac.delta[c] != 0)
+	    queue[qtail++] = ac.delta[c];
+    while (qhead < qtail) {
+	int s = queue[qhead++];
+	for (c=0; c<nclass; ++c) {
+	    int *t = &ac.delta[s * nclass + c];
+	    int f = ac.delta[fail[s] * nclass + c];
+	    if (*t != 0) {
+		fail[*t] = f;
+		matchMerge(&ac.out[*t], &ac.out[f]);
+		ac.final[*t] |= ac.final[f];
+		queue[qtail++] = *t;
+	    } else {
+		*t = f;
+	    }
+	}
     }
+    free(queue);
+    free(fail);
+    rxFinish();
+    ac.valid = true;
 }
 
-static LogBuffer *
-classify(const char *line)
+/**
+ * Make sure the automaton is built. After this, matchLine() only
+ * reads shared state, so it can be called from several threads as
+ * long as the patterns don't change.
+ */
+static void
+matchPrepare()
 {
-    LogBuffer **lb = logbuffers;
-    int i;
-    for (i=0; i < nLogBuffer; ++i, ++lb)
-	if ((*lb)->pat == NULL || strstr(line, (*lb)->pat) != NULL)
-	    return *lb;
-    /* Fell through, use the last one as a "catch-all" */
-    return logbuffers[nLogBuffer-1];
+    if (!ac.valid) acBuild();
 }
 
-#pragma mark -- LogBuffer management --
-
 /**
- * Create one circular buffer for holding logs
- * @param pat - string, which when seen in a log message, causes it
- * to be added to this buffer
- * @param type - single character name for this buffer, e.g. 'D', 'I', 'W', 'E'
- * @param limit — max buffer size in MB
+ * Match one line against every pattern in a single pass.
+ */
+static void
+matchLine(const char *line, size_t len, LineMatch *m)
+{
+    const unsigned char *p = (const unsigned char *)line;
+    const int *delta;
+    int nclass, s = 0;
+    size_t i;
+
+    if (!ac.valid) acBuild();
+    *m = ac.always;
+    delta = ac.delta;
+    nclass = ac.nclass;
+    for (i = len; i > 0; --i) {
+	s = delta[s * nclass + ac.cls[*p++]];
+	if (ac.final[s]) matchMerge(m, &ac.out[s]);
+    }
+    if (rx.start >= 0)
+	rxMatch(line, len, m);
+}
+
+
+
+
+#pragma mark -- Regular expressions --
+
+/*
+ * A pattern written as re:regex is a regular expression rather than a
+ * plain string. The prefix can't be mistaken for a plain string such
+ * as a path, which /regex/ could. All the regexes are compiled
+ * together into one Thompson NFA, which is run as a DFA built lazily,
+ * a state at a time, as lines are matched. There's no backtracking,
+ * so matching is linear in the length of the line whatever the regex.
+ * At most RX_MAXSTATES DFA states are cached; a regex that needs more
+ * just has states rebuilt as they're needed. As with the Aho-Corasick
+ * automaton, the DFA works on classes of bytes rather than bytes.
  *
- * If 'pat' is NULL, then all log messages match.
+ * Supported: . [abc] [^a-z] \d \w \s \D \W \S * + ? {m} {m,} {m,n}
+ * | ( ) ^ $, and \ to quote anything else.
  *
- * The 'type' value may be any character, but 'D', 'I', 'W', 'E' are
- * special when combined with colorization.
+ * Each thread that matches lines has its own DFA cache.
  */
-LogBuffer *
-LogBufferAlloc(const char *pat, char type, long limit)
+
+enum {RX_CHAR, RX_SPLIT, RX_JMP, RX_BOL, RX_EOL, RX_MATCH};
+
+#define RX_PREFIX       "re:"
+#define RX_PREFIXLEN    (sizeof(RX_PREFIX) - 1)
+
+#define RX_MAXNODES     20000
+#define RX_MAXSTATES    1024
+#define RX_MAXREPEAT    1000
+
+/* A piece of NFA; 'end' is the node whose 'out' is still to be set */
+typedef struct {
+    int start, end;
+} RxFrag;
+
+typedef struct {
+    const char *p, *end;
+    const char *err;
+} RxParse;
+
+static RxFrag rxAlt(RxParse *ps);
+static RxFrag rxRepeat(RxParse *ps);
+
+static bool
+rxIs(const char *pat)
 {
-    LogBuffer *lb = malloc(sizeof(*lb));
-    if (lb == NULL) return lb;
-    if (limit < 1000)
-	limit = limit > 0 ? limit * 1024*1024 : 1000;
-    lb->limit = limit;
-    lb->pat = pat;
-    lb->type = type;
-    LogBufferInit(lb);
-    return lb;
+    return pat != NULL && strncmp(pat, RX_PREFIX, RX_PREFIXLEN) == 0;
 }
 
 /**
- * Add this log buffer to the list.
- *
- * Log messages are matched against logbuffer patterns in the order
- * in which they were added until a match is found, a logbuffer with
- * a NULL pattern is found, or the end of the list is reached, in
- * which case the message will go into the last buffer.
+ * Discard all regexes. Called when the patterns are recompiled.
  */
-void
-LogBufferAdd(LogBuffer *lb)
+static void
+rxReset()
 {
-    if (nLogBuffer >= NA(logbuffers)) {
-	fprintf(stderr,
-	    "Too many log buffers (limit %zd), ignored\n",
-	    NA(logbuffers));
-	return;
+    free(rx.nodes);
+    rx.nodes = NULL;
+    rx.nnodes = rx.maxnodes = 0;
+    rx.start = -1;
+    ++rx.gen;
+}
+
+static int
+rxNode(RxParse *ps, int op)
+{
+    RxNode *n;
+
+    if (rx.nnodes >= rx.maxnodes) {
+	int max = rx.maxnodes > 0 ? rx.maxnodes * 2 : 64;
+	RxNode *tmp;
+	if (rx.nnodes >= RX_MAXNODES ||
+	    (tmp = realloc(rx.nodes, max * sizeof(*tmp))) == NULL)
+	{
+	    ps->err = "too big";
+	    return 0;
+	}
+	rx.nodes = tmp;
+	rx.maxnodes = max;
     }
-    logbuffers[nLogBuffer++] = lb;
-    LogBufferInit(lb);
+    n = &rx.nodes[rx.nnodes];
+    memset(n, 0, sizeof(*n));
+    n->op = op;
+    n->out = n->out1 = -1;
+    return rx.nnodes++;
+}
+
+static RxFrag
+rxSingle(RxParse *ps, int op)
+{
+    int n = rxNode(ps, op);
+    return (RxFrag){n, n};
+}
+
+static RxFrag
+rxCat(RxFrag a, RxFrag b)
+{
+    rx.nodes[a.end].out = b.start;
+    return (RxFrag){a.start, b.end};
+}
+
+/* Zero or more (star), one or more (plus), or zero or one */
+static RxFrag
+rxLoop(RxParse *ps, RxFrag f, char how)
+{
+    int s = rxNode(ps, RX_SPLIT), j = rxNode(ps, RX_JMP);
+
+    if (ps->err != NULL) return f;
+    rx.nodes[s].out = f.start;
+    rx.nodes[s].out1 = j;
+    rx.nodes[f.end].out = how == '?' ? j : s;
+    return (RxFrag){how == '+' ? f.start : s, j};
 }
 
 static void
-LogBufferInit(LogBuffer *lb)
+rxSetClass(unsigned char *set, char cls)
 {
-    lb->first = NULL;
-    lb->last = &lb->first;
-    lb->end = NULL;
-    lb->allocated = 0;
-    lb->full = false;
+    int c;
+    for (c=0; c<256; ++c) {
+	bool in;
+	switch (cls | 0x20) {
+	case 'd': in = isdigit(c); break;
+	case 'w': in = isalnum(c) || c == '_'; break;
+	default:  in = isspace(c); break;
+	}
+	if (in != (isupper((unsigned char)cls) != 0))
+	    set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+static inline void
+rxSetByte(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
 }
 
 /**
- * Add one line to this logbuffer
+ * Parse the inside of [...]
  */
-void
-LogBufferAppend(LogBuffer *lb, long seq, const char *line, short fd)
+static void
+rxBracket(RxParse *ps, unsigned char *set)
 {
-    size_t len = strlen(line);
-    LogMsg *msg;
+    bool negate = false;
+    bool first = true;
+    int i;
+
+    if (ps->p < ps->end && *ps->p == '^') {
+	negate = true;
+	++ps->p;
+    }
+    for (;;) {
+	int lo, hi;
+	if (ps->p >= ps->end) {
+	    ps->err = "missing ]";
+	    return;
+	}
+	lo = (unsigned char)*ps->p++;
+	if (lo == ']' && !first) break;
+	first = false;
+	if (lo == '\\' && ps->p < ps->end) {
+	    lo = (unsigned char)*ps->p++;
+	    if (strchr("dwsDWS", lo) != NULL) {
+		rxSetClass(set, lo);
+		continue;
+	    }
+	    if (lo == 't') lo = '\t';
+	}
+	hi = lo;
+	if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+	    hi = (unsigned char)ps->p[1];
+	    ps->p += 2;
+	    if (hi < lo) {
+		ps->err = "bad range";
+		return;
+	    }
+	}
+	for (i = lo; i <= hi; ++i)
+	    rxSetByte(set, i);
+    }
+    if (negate)
+	for (i=0; i<32; ++i)
+	    set[i] = ~set[i];
+}
+
+static RxFrag
+rxAtom(RxParse *ps)
+{
+    RxFrag f;
+    int c = (unsigned char)*ps->p++;
+
+    switch (c) {
+    case '(':
+	f = rxAlt(ps);
+	if (ps->p >= ps->end || *ps->p != ')') {
+	    ps->err = "missing )";
+	    return f;
+	}
+	++ps->p;
+	return f;
+    case '*': case '+': case '?':
+	ps->err = "nothing to repeat";
+	return rxSingle(ps, RX_JMP);
+    case '^':
+	return rxSingle(ps, RX_BOL);
+    case '$':
+	return rxSingle(ps, RX_EOL);
+    }
 
-    if (!lb->full)
-    {
-	/* If the buffer is not full, allocate a new LogMsg object for it */
-	msg = lmAlloc(len);
-	msg->next = NULL;
-	*lb->last = msg;
-	lb->last = &msg->next;
-	lb->allocated += sizeof(*msg) + len + 1;
-	if (lb->allocated >= lb->limit) {
-	    lb->full = true;
+    f = rxSingle(ps, RX_CHAR);
+    if (ps->err != NULL) return f;
+    switch (c) {
+    case '.':
+	memset(rx.nodes[f.start].set, 0xff, 32);
+	break;
+    case '[':
+	rxBracket(ps, rx.nodes[f.start].set);
+	break;
+    case '\\':
+	if (ps->p >= ps->end) {
+	    ps->err = "trailing \\";
+	    break;
 	}
-    } else {
-	/* Buffer is full, recycle lb->end->next */
-	LogMsg *prev = lb->end, *next;
-	msg = prev->next != NULL ? prev->next : lb->first;
-	if (len > msg->linelen) {
-	    /* Ooops, need to allocate a bigger one */
-	    next = msg->next;
-	    free(msg);
-	    msg = lmAlloc(len);
-	    msg->next = next;
-	    if (lb->end->next == NULL) lb->first = msg;
-	    else lb->end->next = msg;
-	}
-    }
-    lb->end = msg;
-    msg->seq = seq;
-    msg->time = time(NULL);
-    msg->fd = fd;
-    msg->type = lb->type;
-    memcpy(msg->line, line, len+1);
+	c = (unsigned char)*ps->p++;
+	if (strchr("dwsDWS", c) != NULL) {
+	    rxSetClass(rx.nodes[f.start].set, c);
+	    break;
+	}
+	if (c == 't') c = '\t';
+	/* fall through */
+    default:
+	rxSetByte(rx.nodes[f.start].set, c);
+	break;
+    }
+    return f;
 }
 
 /**
- * Empty a log buffer.
+ * Parse {m}, {m,} or {m,n}. Returns false, leaving the input alone, if
+ * this isn't one, in which case the { is just a character.
  */
-void
-LogBufferClear(LogBuffer *lb)
+static bool
+rxBraces(RxParse *ps, int *min, int *max)
 {
-    LogMsg *msg, *next;
-    for (msg = lb->first; msg != NULL; msg = next)
+    const char *p = ps->p + 1;
+    char *ep;
+
+    if (p >= ps->end || !isdigit(*p)) return false;
+    *min = *max = strtol(p, &ep, 10);
+    p = ep;
+    if (p < ps->end && *p == ',') {
+	++p;
+	*max = -1;
+	if (p < ps->end && isdigit(*p)) {
+	    *max = strtol(p, &ep, 10);
+	    p = ep;
+	}
+    }
+    if (p >= ps->end || *p != '}') return false;
+    if (*min > RX_MAXREPEAT || *max > RX_MAXREPEAT ||
+	(*max >= 0 && *max < *min))
     {
-	next = msg->next;
-	free(msg);
+	ps->err = "bad repeat count";
     }
-    LogBufferInit(lb);
+    ps->p = p + 1;
+    return true;
 }
 
 /**
- * Set up to iterate
+ * Parse the text from 'at' to 'stop' again, for another copy of a
+ * repeated piece.
  */
-static void
-LogBufferIterator(LogBuffer *lb)
+static RxFrag
+rxReparse(RxParse *ps, const char *at, const char *stop)
 {
-    /* Iteration starts at itEnd->next and loops around until
-     * we're back at itEnd
-     */
-    lb->iter = lb->end;
+    RxParse sub = {at, stop, NULL};
+    RxFrag f = rxRepeat(&sub);
+    if (sub.err != NULL) ps->err = sub.err;
+    return f;
 }
 
 /**
- * Return next logmessage, or NULL if exhausted
+ * Expand f{min,max}. 'f' is the text from 'at' to 'stop'.
  */
-static LogMsg *
-LogBufferNext(LogBuffer *lb)
+static RxFrag
+rxCount(RxParse *ps, RxFrag f, const char *at, const char *stop,
+    int min, int max)
 {
-    LogMsg *next;
-    if (lb->iter == NULL) return NULL;
-    next = lb->iter->next;
-    if (next == 0) next = lb->first;
-    if (next == lb->end) lb->iter =  NULL;
-    else lb->iter = next;
-    return next;
+    RxFrag out = rxSingle(ps, RX_JMP), c;
+    bool used = false;
+    int i;
+
+    for (i=0; ps->err == NULL && (i < min || i < max || (max < 0 && i == min));
+	 ++i)
+    {
+	c = used ? rxReparse(ps, at, stop) : f;
+	used = true;
+	if (ps->err != NULL) break;
+	if (i >= min)
+	    c = rxLoop(ps, c, max < 0 ? '*' : '?');
+	out = rxCat(out, c);
+    }
+    return out;
 }
 
-static LogMsg *
-lmAlloc(size_t len)
+/* An atom followed by any number of *, +, ? or {m,n} */
+static RxFrag
+rxRepeat(RxParse *ps)
 {
-    LogMsg *msg = malloc(sizeof(*msg) + len + 1);
-    msg->linelen = len;
-    return msg;
+    const char *at = ps->p;
+    RxFrag f = rxAtom(ps);
+    int min, max;
+
+    while (ps->err == NULL && ps->p < ps->end) {
+	const char *stop = ps->p;
+	int c = *ps->p;
+	if (c == '*' || c == '+' || c == '?') {
+	    ++ps->p;
+	    f = rxLoop(ps, f, c);
+	} else if (c == '{' && rxBraces(ps, &min, &max)) {
+	    if (ps->err == NULL)
+		f = rxCount(ps, f, at, stop, min, max);
+	} else {
+	    break;
+	}
+    }
+    return f;
 }
 
-#if 0
+static RxFrag
+rxConcat(RxParse *ps)
+{
+    RxFrag f = rxSingle(ps, RX_JMP);
+
+    while (ps->err == NULL && ps->p < ps->end &&
+	   *ps->p != '|' && *ps->p != ')')
+    {
+	f = rxCat(f, rxRepeat(ps));
+    }
+    return f;
+}
+
+static RxFrag
+rxAlt(RxParse *ps)
+{
+    RxFrag f = rxConcat(ps), g;
+    int s, j;
+
+    while (ps->err == NULL && ps->p < ps->end && *ps->p == '|') {
+	++ps->p;
+	g = rxConcat(ps);
+	s = rxNode(ps, RX_SPLIT);
+	j = rxNode(ps, RX_JMP);
+	if (ps->err != NULL) break;
+	rx.nodes[s].out = f.start;
+	rx.nodes[s].out1 = g.start;
+	rx.nodes[f.end].out = j;
+	rx.nodes[g.end].out = j;
+	f = (RxFrag){s, j};
+    }
+    return f;
+}
+
+/**
+ * Compile one re:regex pattern into the NFA. A bad regex is reported
+ * and ignored.
+ */
 static void
-LogBufferDump(LogBuffer *lb)
+rxAdd(const char *pat, const LineMatch *result)
 {
-    LogMsg *msg;
-    for (msg = lb->first; msg != NULL; msg = msg->next) {
-	printf("%ld %c %s %s\n",
-	  msg->seq, msg->type, timeStr(msg->time), msg->line);
+    RxParse ps = {pat + RX_PREFIXLEN, pat + strlen(pat), NULL};
+    int mark = rx.nnodes, m, s = -1;
+    RxFrag f = rxAlt(&ps);
+
+    if (ps.err == NULL && ps.p < ps.end)
+	ps.err = "unmatched )";
+    m = rxNode(&ps, RX_MATCH);
+    if (rx.start >= 0)
+	s = rxNode(&ps, RX_SPLIT);
+    if (ps.err != NULL) {
+	fprintf(stderr, "Bad regex %s: %s, ignored\n", pat, ps.err);
+	rx.nnodes = mark;
+	return;
+    }
+    rx.nodes[m].result = *result;
+    rx.nodes[f.end].out = m;
+    if (rx.start >= 0) {
+	rx.nodes[s].out = f.start;
+	rx.nodes[s].out1 = rx.start;
+	f.start = s;
     }
+    rx.start = f.start;
 }
 
+/**
+ * Work out the byte classes, once all the regexes are added.
+ */
 static void
-LogBufferIterate(LogBuffer *lb)
+rxFinish()
 {
-    LogMsg *msg;
-    lbIterator(lb);
-    while ((msg = lbNext(lb)) != NULL) {
-	printf("%ld %c %s %s\n",
-	  msg->seq, msg->type, timeStr(msg->time), msg->line);
+    int map[512], i, b;
+
+    memset(rx.cls, 0, sizeof(rx.cls));
+    rx.nclass = 1;
+    /* Split the classes by each RX_CHAR node's set in turn */
+    for (i=0; i<rx.nnodes; ++i) {
+	RxNode *nd = &rx.nodes[i];
+	int n = 0;
+	if (nd->op != RX_CHAR) continue;
+	memset(map, 0xff, 2 * rx.nclass * sizeof(int));
+	for (b=0; b<256; ++b) {
+	    int k = rx.cls[b] * 2 + ((nd->set[b >> 3] >> (b & 7)) & 1);
+	    if (map[k] < 0) map[k] = n++;
+	    rx.cls[b] = map[k];
+	}
+	rx.nclass = n;
     }
+    for (b=255; b>=0; --b)
+	rx.rep[rx.cls[b]] = b;
 }
-#endif
 
-#pragma mark -- Exclusion patterns --
+/* One cached DFA state: a set of NFA nodes */
+typedef struct {
+    int *set;           /* RX_CHAR, RX_EOL and RX_MATCH nodes, sorted */
+    int nset;
+    int *next;          /* Next state by class, -1 if not built yet */
+    LineMatch out;      /* Merged results of the RX_MATCH nodes */
+    bool final;
+    LineMatch eol;      /* Results if the line ends here */
+    bool eolFinal;
+    bool eolKnown;      /* eol has been worked out */
+} RxState;
 
-static const char *excludePats[100];
-static int numExclude = 0;
+typedef struct {
+    unsigned gen;       /* rx.gen this cache was built for */
+    RxState states[RX_MAXSTATES];
+    int nstates;
+    int hash[2 * RX_MAXSTATES];  /* State indices, -1 if empty */
+    int start;          /* State at the start of a line, or -1 */
+    int *pool;          /* Storage for the states' next[] and set[] */
+    size_t poolUsed, poolSize;
+    int *stack, *set, *seen;     /* Scratch, sized for the NFA */
+    int stamp;
+    unsigned flushes;
+} RxCache;
+
+static pthread_key_t rxKey;
+static pthread_once_t rxOnce = PTHREAD_ONCE_INIT;
+static _Thread_local RxCache *rxSelf;
 
+/* Forget all DFA states */
 static void
-rstrip(char *buffer)
+rxFlush(RxCache *c)
 {
-    size_t len = strlen(buffer);
-    if (len > 0 && buffer[len-1] == '\n')
-	buffer[len-1] = '\0';
+    c->poolUsed = 0;
+    c->nstates = 0;
+    c->start = -1;
+    ++c->flushes;
+    memset(c->hash, 0xff, sizeof(c->hash));
 }
 
-/**
- * Add this string to the exclusion patterns. If 'pat' is encountered
- * in a log message, the message is discarded.
- */
-void
-ExcludeAdd(const char *pat)
+static void
+rxFree(void *arg)
 {
-    if (numExclude >= NA(excludePats)) {
-	fprintf(stderr,
-	    "Too many exclude patterns (limit %zd), \"%s\" ignored\n",
-	    NA(excludePats), pat);
-	return;
-    }
-    excludePats[numExclude++] = pat;
+    RxCache *c = arg;
+    free(c->pool);
+    free(c->stack);
+    free(c->set);
+    free(c->seen);
+    free(c);
+}
+
+static void
+rxKeyInit()
+{
+    pthread_key_create(&rxKey, rxFree);
 }
 
 /**
- * Add strings from a file to the exclusion patterns
+ * Return this thread's cache, set up for the current NFA.
  */
-void
-ExcludeAddFile(const char *filename)
+static RxCache *
+rxCache()
 {
-    FILE *xfile = fopen(filename, "r");
-    char pat[1024];
-    if (xfile == NULL) {
-	perror(filename);
-	return;
+    RxCache *c = rxSelf;
+
+    if (c != NULL && c->gen == rx.gen) return c;
+    if (c == NULL) {
+	pthread_once(&rxOnce, rxKeyInit);
+	if ((c = calloc(1, sizeof(*c))) == NULL) return NULL;
+	pthread_setspecific(rxKey, c);
+	rxSelf = c;
     }
-    while (fgets(pat, sizeof(pat), xfile) != NULL)
+    rxFlush(c);
+    free(c->pool);
+    free(c->stack);
+    free(c->set);
+    free(c->seen);
+    /* Room for RX_MAXSTATES typical states, and at least one huge one */
+    c->poolSize = RX_MAXSTATES * (rx.nclass + 32) + rx.nnodes;
+    c->pool = malloc(c->poolSize * sizeof(int));
+    c->stack = malloc((2 * rx.nnodes + 1) * sizeof(int));
+    c->set = malloc(rx.nnodes * sizeof(int));
+    c->seen = calloc(rx.nnodes, sizeof(int));
+    if (c->pool == NULL || c->stack == NULL || c->set == NULL ||
+	c->seen == NULL)
     {
-	rstrip(pat);
-	ExcludeAdd(strdup(pat));
+	c->gen = rx.gen - 1;
+	return NULL;
     }
-    fclose(xfile);
+    c->stamp = 0;
+    c->gen = rx.gen;
+    return c;
 }
 
 /**
- * Check this line against all patterns, return true if exlcuded.
+ * Follow the empty transitions from the nodes on the stack, and put
+ * the nodes reached that matter into c->set, sorted. RX_BOL is passed
+ * only at the start of the line. Returns the size of the set.
  */
-bool
-ExcludeTest(const char *line)
+static int
+rxClosure(RxCache *c, int sp, bool bol)
 {
-    int i;
-    for (i=0; i<numExclude; ++i) {
-	if (strstr(line, excludePats[i]) != NULL)
-	    return true;
+    int n = 0, j;
+
+    ++c->stamp;
+    while (sp > 0) {
+	int i = c->stack[--sp];
+	RxNode *nd;
+	if (i < 0 || c->seen[i] == c->stamp) continue;
+	c->seen[i] = c->stamp;
+	nd = &rx.nodes[i];
+	switch (nd->op) {
+	case RX_SPLIT:
+	    c->stack[sp++] = nd->out1;
+	    /* fall through */
+	case RX_JMP:
+	    c->stack[sp++] = nd->out;
+	    break;
+	case RX_BOL:
+	    if (bol) c->stack[sp++] = nd->out;
+	    break;
+	default:
+	    /* Insertion sort; sets are small */
+	    for (j = n++; j > 0 && c->set[j-1] > i; --j)
+		c->set[j] = c->set[j-1];
+	    c->set[j] = i;
+	    break;
+	}
     }
-    return false;
+    return n;
 }
 
-
-#pragma mark -- Triggers --
-
-static int triggerCount, tcontext;
-static const char *triggers[MAX_TRIGGERS];
-
 /**
- * Set the trigger parameters.
- * @param count      Number of times the trigger has to be seen
- * @param context    Number of log events recorded after the trigger
- *
- * Once the trigger is seen 'count' times, and then 'context' log
- * events have been seen, the logs are dumped and then disabled.
- *
- * Once a trigger has occurred, you need to call this again to
- * "re-arm" it.
+ * Find or make the state for the n nodes in c->set.
  */
-void
-TriggerParams(int count, int context)
+static int
+rxState(RxCache *c, int n)
 {
-    triggerCount = count;
-    tcontext = context;
+    static const LineMatch none = {INT_MAX, INT_MAX, false};
+    unsigned h = n;
+    int i, slot;
+    RxState *st;
+
+    for (i=0; i<n; ++i)
+	h = h * 31 + c->set[i];
+    for (slot = h % NA(c->hash); c->hash[slot] >= 0;
+	 slot = (slot + 1) % NA(c->hash))
+    {
+	st = &c->states[c->hash[slot]];
+	if (st->nset == n && memcmp(st->set, c->set, n * sizeof(int)) == 0)
+	    return c->hash[slot];
+    }
+
+    if (c->nstates >= RX_MAXSTATES ||
+	c->poolUsed + rx.nclass + n > c->poolSize)
+    {
+	rxFlush(c);
+	return rxState(c, n);
+    }
+    st = &c->states[c->nstates];
+    st->next = c->pool + c->poolUsed;
+    st->set = st->next + rx.nclass;
+    c->poolUsed += rx.nclass + n;
+    memcpy(st->set, c->set, n * sizeof(int));
+    st->nset = n;
+    memset(st->next, 0xff, rx.nclass * sizeof(int));
+    st->out = st->eol = none;
+    st->final = st->eolFinal = st->eolKnown = false;
+    c->hash[slot] = c->nstates;
+
+    for (i=0; i<n; ++i) {
+	RxNode *nd = &rx.nodes[st->set[i]];
+	if (nd->op == RX_MATCH) {
+	    matchMerge(&st->out, &nd->result);
+	    st->final = true;
+	}
+    }
+    return c->nstates++;
 }
 
 /**
- * Add a string to the trigger list.
+ * Work out what the line ending in state s means, for $.
  */
-void
-TriggerAdd(const char *trigger)
+static void
+rxEol(RxCache *c, RxState *st)
 {
-    if (numTrigger >= NA(triggers)) {
-	fprintf(stderr,
-	    "Too many trigger patterns (limit %zd), \"%s\" ignored\n",
-	    NA(triggers), trigger);
-	return;
+    int i, n, sp = 0;
+
+    for (i=0; i<st->nset; ++i) {
+	RxNode *nd = &rx.nodes[st->set[i]];
+	if (nd->op == RX_EOL)
+	    c->stack[sp++] = nd->out;
     }
-    triggers[numTrigger++] = trigger;
+    n = rxClosure(c, sp, false);
+    for (i=0; i<n; ++i) {
+	RxNode *nd = &rx.nodes[c->set[i]];
+	if (nd->op == RX_MATCH) {
+	    matchMerge(&st->eol, &nd->result);
+	    st->eolFinal = true;
+	}
+    }
+    st->eolKnown = true;
 }
 
 /**
- * Check this line against all patterns, return matching trigger or NULL
- * if no match.
+ * Build the transition from state s on byte class k. Every step
+ * restarts the NFA too, since a match may begin anywhere in the line.
  */
-const char *
-TriggerTest(const char *line)
+static int
+rxStep(RxCache *c, int s, int k)
 {
-    int i;
-    for (i=0; i<numTrigger; ++i) {
-	if (strstr(line, triggers[i]) != NULL)
-	    return triggers[i];
+    RxState *st = &c->states[s];
+    unsigned flushes = c->flushes;
+    int i, t, sp = 0, b = rx.rep[k];
+
+    for (i=0; i<st->nset; ++i) {
+	RxNode *nd = &rx.nodes[st->set[i]];
+	if (nd->op == RX_CHAR && (nd->set[b >> 3] & (1 << (b & 7))))
+	    c->stack[sp++] = nd->out;
     }
-    return NULL;
+    c->stack[sp++] = rx.start;
+    t = rxState(c, rxClosure(c, sp, false));
+    /* If the cache was flushed, s is gone */
+    if (c->flushes == flushes)
+	st->next[k] = t;
+    return t;
 }
 
 /**
- * Check this line against the trigger patterns. Counting matching
- * triggers and executing the context countdown as appropriate. Return true if
- * all conditions satisfied and it's time to dump the logs.
+ * Match a line against all the regexes.
  */
-bool
-TriggerCheck(const char *str)
+static void
+rxMatch(const char *line, size_t len, LineMatch *m)
 {
-    const char *match;
-    if (numTrigger <= 0) return false;
-    if (tcontext <= 0) return true;
-    if (triggerCount <= 0) return --tcontext <= 0;
-    if ((match = TriggerTest(str)) != NULL) {
-	fprintf(stderr, "log triggered, pattern \"%s\"\n", match);
-	--triggerCount;
+    const unsigned char *p = (const unsigned char *)line;
+    RxCache *c = rxCache();
+    int s;
+
+    if (c == NULL) return;
+    if ((s = c->start) < 0) {
+	c->stack[0] = rx.start;
+	s = c->start = rxState(c, rxClosure(c, 1, true));
     }
-    return false;
+    for (; len > 0; --len) {
+	int k = rx.cls[*p++];
+	int t = c->states[s].next[k];
+	s = t >= 0 ? t : rxStep(c, s, k);
+	if (c->states[s].final) matchMerge(m, &c->states[s].out);
+    }
+    if (!c->states[s].eolKnown) rxEol(c, &c->states[s]);
+    if (c->states[s].eolFinal) matchMerge(m, &c->states[s].eol);
 }
 
 
-
-
 #pragma mark -- NBFile module --
 
 /**
- * Like a stdio FILE, but doesn't return partial lines
+ * Like a stdio FILE, but doesn't return partial lines. Each call to
+ * NBFileRead() splits everything buffered so far into complete lines
+ * in one pass.
+ *
+ * A line that doesn't fit in the buffer doubles it, up to maxline,
+ * so a long line costs O(n) copying in all, and the buffer goes back
+ * to its usual size once the line is done. Past maxline, the first
+ * maxline bytes are kept and the rest of the line is read into the
+ * space after them and thrown away, counting it, until its newline
+ * turns up. The line is then returned with TRUNC_MARK on the end.
+ * Complete lines over maxline are cut in place by lineTruncate().
  */
 struct nbfile {
     int fd;
-    int ptr;	/* pointer to next char to return */
-    int len;	/* total chars in buffer */
-    char buffer[2048];
+    bool eof;           /* read() has returned end of file */
+    size_t ptr;         /* offset of next char to return */
+    size_t len;         /* chars in buffer after ptr */
+    size_t scanned;     /* chars after ptr known to hold no newline */
+    size_t size;        /* size of buffer */
+    size_t base;        /* usual size of buffer */
+    size_t keep;        /* length kept of a line being truncated */
+    long long skipped;  /* bytes of it discarded so far, or -1 */
+    char *buffer;
 };
 
 static NBFile *
@@ -827,47 +6779,288 @@ NBFileOpen(int fd)
     NBFile *file = malloc(sizeof(*file));
     if (file == NULL) return NULL;
     file->fd = fd;
-    file->ptr = file->len = 0;
+    file->eof = false;
+    file->ptr = file->len = file->scanned = 0;
+    file->size = file->base = readbufsize > 4096 ? readbufsize : 4096;
+    file->skipped = -1;
+    if ((file->buffer = malloc(file->size)) == NULL) {
+	free(file);
+	return NULL;
+    }
     return file;
 }
 
-static char *
-NBFileRead(NBFile *file)
+/**
+ * Return true once the writer has closed its end
+ */
+static bool
+NBFileEof(NBFile *file)
+{
+    return file->eof;
+}
+
+/**
+ * Newline scanners. Each one stores the offsets of up to 'max'
+ * newlines in buf[0..len) into offs[] and returns how many it found.
+ * The vector versions are chosen at run time if the CPU has them.
+ */
+static size_t
+nlScanScalar(const char *buf, size_t len, size_t *offs, size_t max)
+{
+    const char *p = buf, *end = buf + len, *nl;
+    size_t n = 0;
+    while (n < max && (nl = memchr(p, '\n', end - p)) != NULL) {
+	offs[n++] = nl - buf;
+	p = nl + 1;
+    }
+    return n;
+}
+
+#ifdef HAVE_SIMD_SCAN
+__attribute__((target("sse2")))
+static size_t
+nlScanSSE2(const char *buf, size_t len, size_t *offs, size_t max)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i, n = 0, k;
+    unsigned int mask;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+	for (; mask != 0; mask &= mask - 1) {
+	    if (n >= max) return n;
+	    offs[n++] = i + __builtin_ctz(mask);
+	}
+    }
+    k = nlScanScalar(buf + i, len - i, offs + n, max - n);
+    while (k-- > 0) offs[n++] += i;
+    return n;
+}
+
+__attribute__((target("avx2")))
+static size_t
+nlScanAVX2(const char *buf, size_t len, size_t *offs, size_t max)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i, n = 0, k;
+    unsigned int mask;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+	mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+	for (; mask != 0; mask &= mask - 1) {
+	    if (n >= max) return n;
+	    offs[n++] = i + __builtin_ctz(mask);
+	}
+    }
+    k = nlScanScalar(buf + i, len - i, offs + n, max - n);
+    while (k-- > 0) offs[n++] += i;
+    return n;
+}
+#endif
+
+static size_t nlScanInit(const char *buf, size_t len, size_t *offs, size_t max);
+static size_t (*nlScan)(const char *, size_t, size_t *, size_t) = nlScanInit;
+
+static size_t
+nlScanInit(const char *buf, size_t len, size_t *offs, size_t max)
+{
+    nlScan = nlScanScalar;
+#ifdef HAVE_SIMD_SCAN
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	nlScan = nlScanAVX2;
+    else if (__builtin_cpu_supports("sse2"))
+	nlScan = nlScanSSE2;
+#endif
+    return nlScan(buf, len, offs, max);
+}
+
+/**
+ * Cut a complete line down to about maxline bytes, in place, ending it
+ * with TRUNC_MARK. If the mark doesn't fit in what's cut, a little
+ * less is kept. Returns the new length.
+ */
+static size_t
+lineTruncate(char *line, size_t len)
+{
+    size_t keep = maxline;
+    int m;
+
+    if (len < 2 * TRUNC_ROOM)
+	return len;
+    if (keep + TRUNC_ROOM > len)
+	keep = len - TRUNC_ROOM;
+    m = snprintf(line + keep, TRUNC_ROOM, TRUNC_MARK, (long long)(len - keep));
+    ++stats.truncated;
+    stats.truncBytes += len - keep;
+    return keep + m;
+}
+
+/**
+ * Split the buffered data into up to 'max' complete lines. Newlines
+ * are replaced with nul bytes.
+ */
+static int
+NBFileSplit(NBFile *file, LineSpan *spans, int max)
+{
+    size_t offs[256];
+    char *start = file->buffer + file->ptr;
+    size_t i, n, consumed;
+
+    if (max > NA(offs)) max = NA(offs);
+    n = nlScan(start + file->scanned, file->len - file->scanned, offs, max);
+    if (n == 0) {
+	file->scanned = file->len;
+	return 0;
+    }
+    consumed = 0;
+    for (i=0; i<n; ++i) {
+	size_t nl = file->scanned + offs[i];
+	spans[i].line = start + consumed;
+	spans[i].len = nl - consumed;
+	start[nl] = '\0';
+	if (maxline > 0 && spans[i].len > (size_t)maxline)
+	    spans[i].len = lineTruncate(spans[i].line, spans[i].len);
+	consumed = nl + 1;
+    }
+    file->ptr += consumed;
+    file->len -= consumed;
+    file->scanned = 0;
+    if (file->len == 0) file->ptr = 0;
+    return n;
+}
+
+static bool
+NBFileResize(NBFile *file, size_t size)
+{
+    char *tmp = realloc(file->buffer, size);
+    if (tmp == NULL) return false;
+    file->buffer = tmp;
+    file->size = size;
+    return true;
+}
+
+/**
+ * Read and discard the rest of a line past maxline. Returns 1 with
+ * the truncated line in spans[0] once its end is found, else 0.
+ */
+static int
+NBFileSkip(NBFile *file, LineSpan *spans)
 {
+    char *start = file->buffer + file->keep + TRUNC_ROOM;
+    size_t room = file->size - file->keep - TRUNC_ROOM - 1;
+    char *nl = NULL;
     ssize_t len;
-    char *rval, *ptr;
-    /* Read from fd until no more or buffer is full */
-    for(;;) {
-	int iptr = file->ptr + file->len;
-	int maxread = sizeof(file->buffer) - iptr - 1;
-	if (maxread <= 0) break;
-	len = read(file->fd, file->buffer + iptr, maxread);
+
+    for (;;) {
+	len = read(file->fd, start, room);
+	if (len == 0) file->eof = true;
 	if (len <= 0) break;
-	file->len += len;
+	++stats.reads;
+	if ((nl = memchr(start, '\n', len)) != NULL) {
+	    file->skipped += nl - start;
+	    file->ptr = nl + 1 - file->buffer;
+	    file->len = start + len - (nl + 1);
+	    break;
+	}
+	file->skipped += len;
     }
-    file->buffer[file->ptr + file->len] = '\0';
-    if (file->len <= 0) {
+    if (nl == NULL) {
+	if (!file->eof) return 0;
 	file->ptr = file->len = 0;
-	return NULL;
     }
-    rval = file->buffer + file->ptr;
-    ptr = strchr(rval, '\n');
-    if (ptr != NULL) {
-	/* Have a full line, terminate and return it */
-	len = ptr - rval;
-	*ptr = '\0';
-	file->ptr += len + 1;
-	file->len -= len + 1;
-	return rval;
-    } else {
-	/* partial line */
-	if (file->ptr + file->len >= sizeof(file->buffer) - 100) {
-	    /* Partial line and low on room */
-	    memmove(file->buffer, file->buffer + file->ptr, file->len);
-	    file->ptr = 0;
+
+    spans[0].line = file->buffer;
+    spans[0].len = file->keep + snprintf(file->buffer + file->keep,
+					 TRUNC_ROOM, TRUNC_MARK, file->skipped);
+    ++stats.truncated;
+    stats.truncBytes += file->skipped;
+    file->skipped = -1;
+    file->scanned = 0;
+    return 1;
+}
+
+/**
+ * Return up to 'max' complete lines from this file, reading more
+ * data only when no complete line is already buffered. Returns the
+ * number of lines, 0 if none are available yet.
+ */
+static int
+NBFileRead(NBFile *file, LineSpan *spans, int max)
+{
+    ssize_t len;
+    int n;
+
+    if (file->skipped >= 0)
+	return NBFileSkip(file, spans);
+
+    if (file->len > file->scanned &&
+	(n = NBFileSplit(file, spans, max)) > 0)
+    {
+	return n;
+    }
+
+    /* Only a partial line is left; move it to the front */
+    if (file->ptr > 0) {
+	if (file->len > 0) {
+	    ++stats.moves;
+	    stats.moveBytes += file->len;
 	}
-	return NULL;
+	memmove(file->buffer, file->buffer + file->ptr, file->len);
+	file->ptr = 0;
+    }
+    /* Give back the space a long line needed */
+    if (file->len == 0 && file->size > file->base)
+	NBFileResize(file, file->base);
+
+    for (;;) {
+	/* Read from fd until no more or buffer is full */
+	for(;;) {
+	    size_t maxread = file->size - file->len - 1;
+	    if (maxread <= 0) break;
+	    len = read(file->fd, file->buffer + file->len, maxread);
+	    if (len == 0) file->eof = true;
+	    if (len <= 0) break;
+	    ++stats.reads;
+	    file->len += len;
+	}
+	if (file->len <= 0) return 0;
+
+	if ((n = NBFileSplit(file, spans, max)) > 0)
+	    return n;
+
+	/* Everything buffered is one partial line */
+	if (maxline > 0 && file->len >= (size_t)maxline) {
+	    size_t need = maxline + TRUNC_ROOM + file->base;
+	    if (file->size < need && !NBFileResize(file, need))
+		break;
+	    file->keep = maxline;
+	    file->skipped = file->len - maxline;
+	    file->len = 0;
+	    return NBFileSkip(file, spans);
+	}
+	if (file->eof)
+	    break;
+	if (file->len < file->size - 1)
+	    return 0;
+	/* It fills the buffer; make room for the rest */
+	if (!NBFileResize(file, maxline > 0 && file->size * 2 > (size_t)maxline ?
+			  maxline + TRUNC_ROOM + file->base : file->size * 2))
+	    break;
     }
+
+    /* An unterminated last line, or one we have no room for; return
+     * what we have
+     */
+    spans[0].line = file->buffer;
+    spans[0].len = file->len;
+    file->buffer[file->len] = '\0';
+    if (maxline > 0 && spans[0].len > (size_t)maxline)
+	spans[0].len = lineTruncate(spans[0].line, spans[0].len);
+    file->ptr = file->len = file->scanned = 0;
+    return 1;
 }
 
 
@@ -899,11 +7092,12 @@ ansiColor(int n)
  * Return color escape code
  */
 static const char *
-colorStart(char type, int fd)
+colorStart(char type, int fd, int tid)
 {
     switch (showcolor) {
       case NONE: return "";
       case FDS: return ansiColor(fd-1);
+      case THREADS: return ansiColor(tid);
       case SEVERITY:
 	  switch (type) {
 	    case 'D': return ansiColor(4);
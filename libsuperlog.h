@@ -3,8 +3,8 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
-
-#define	MAX_FDS	8
+#include <stddef.h>
+#include <stdint.h>
 
 
 #ifdef __cplusplus
@@ -17,6 +17,7 @@ extern "C" {
 
 typedef struct LogMsg LogMsg;
 typedef struct LogBuffer LogBuffer;
+typedef struct SuperlogFormat SuperlogFormat;
 
 
 /**
@@ -38,6 +39,34 @@ extern void superlog(const char *fmt, ...);
  */
 extern void vsuperlog(const char *fmt, va_list ap);
 
+/**
+ * Register a printf-style format string for superlogDeferred(). Call
+ * this once per call site; SUPERLOGD() does it for you.
+ */
+extern SuperlogFormat *superlogFormat(const char *fmt);
+
+/**
+ * Like superlog(), but formatting is deferred until superlog dumps the
+ * logs. Only the format's identity and the raw arguments are sent,
+ * which is much cheaper than printf. Strings are copied at call time.
+ *
+ * This needs the shared memory ring (superlog -shm); without it, or for
+ * formats using %n, %m or positional arguments, the message is formatted
+ * immediately as by superlog(). Patterns are matched against the format
+ * string, not the formatted message.
+ */
+extern void superlogDeferred(SuperlogFormat *fmt, ...);
+
+/**
+ * Convenience wrapper for superlogDeferred():
+ *   SUPERLOGD("request %d took %.3f ms\n", id, ms);
+ */
+#define SUPERLOGD(fmt, ...) do { \
+	static SuperlogFormat *_superlog_fmt; \
+	if (_superlog_fmt == NULL) _superlog_fmt = superlogFormat(fmt); \
+	superlogDeferred(_superlog_fmt, ##__VA_ARGS__); \
+    } while (0)
+
 /**
  * Trigger superlog to dump the logs.
  * Does this by sending SIGUSR1 to the parent
@@ -46,6 +75,21 @@ extern void vsuperlog(const char *fmt, va_list ap);
  */
 extern void superlogDump();
 
+/**
+ * Send any messages buffered by superlog(). Happens automatically at
+ * thread and process exit and in superlogDump().
+ */
+extern void superlogFlush();
+
+/**
+ * If non-zero, superlog() messages sent over the pipe are collected
+ * per thread and written in batches of up to PIPE_BUF bytes, and a
+ * batch is sent once its oldest message is this many milliseconds
+ * old. This saves system calls, but messages still buffered when the
+ * process crashes are lost. Default 0, write every message at once.
+ */
+extern int superlog_flush_ms;
+
 
 
 
@@ -78,26 +122,215 @@ extern void superlogDump();
 extern int SuperLog(int *fds, int nfd, char **argv,
     int (*func)(int argc, char **argv), const char *file);
 
+/**
+ * Add a command for SuperLogChildren() to run, collecting what it
+ * writes on fds[]. Its lines are tagged with 'name'.
+ * @return the child's number, from 1, or -1 on error
+ */
+extern int ChildAdd(const char *name, int *fds, int nfds, char **argv);
+
+/**
+ * Add a process that's already running for SuperLogChildren() to
+ * collect. It writes its logs to the FIFO at 'path' (see mkfifo(1)).
+ * @return the child's number, from 1, or -1 on error
+ */
+extern int ChildAdopt(const char *name, const char *path);
+
+/**
+ * Like SuperLog(), but runs every command given to ChildAdd() and
+ * collects them, and the processes given to ChildAdopt(), into the
+ * same LogBuffers. Each line is tagged with its child's name, and a
+ * dump merges all of them in the order they arrived. Returns when
+ * every command has exited; see childexit. Return values as for
+ * SuperLog().
+ */
+extern int SuperLogChildren(const char *file);
+
+/**
+ * What SuperLogChildren() does when one of its commands exits:
+ * CHILD_CONTINUE carries on until all have, CHILD_DUMP dumps the logs
+ * and carries on, and CHILD_STOP stops the rest with SIGTERM and
+ * finishes.
+ */
+extern enum childexit {CHILD_CONTINUE, CHILD_DUMP, CHILD_STOP} childexit;
+
 
 extern bool timestamps;
 extern bool showfds;
+extern bool showthreads;        /* Include client thread ids in the dump */
 extern bool verbose;
-extern enum colorize {NONE, FDS, SEVERITY} showcolor;
+extern enum colorize {NONE, FDS, SEVERITY, THREADS} showcolor;
+
+/**
+ * How lines are sorted into LogBuffers. By default, by the buffers'
+ * patterns. The other modes read the severity from a known place in
+ * the line, and put it in the first buffer whose type matches ('D',
+ * 'I', 'W' or 'E'), or the last buffer. Lines where no severity is
+ * found fall back to the patterns.
+ *   SEV_COLUMN  the first letter of the word at byte sevcolumn
+ *   SEV_GLOG    glog's leading I, W, E or F
+ *   SEV_SYSLOG  the severity in a leading <PRI>
+ *   SEV_JSON    the value of the sevkey key, by default "level"
+ */
+extern enum sevparse {SEV_PATTERNS, SEV_COLUMN, SEV_GLOG, SEV_SYSLOG,
+    SEV_JSON} sevparse;
+extern int sevcolumn;
+extern const char *sevkey;
+
+/**
+ * Size in bytes of the buffer used to read from each of the child's
+ * fds. Larger values let one read() drain more of a full pipe.
+ * Set before calling SuperLog() or LogParent().
+ */
+extern long readbufsize;
 
 /**
- * Dump logs and clear them
+ * Longest line kept, in bytes; 0 for no limit. The read buffer grows
+ * as needed for a long line, up to this. Anything past it is discarded
+ * and the line ends with " ...[N bytes truncated]". A line too long
+ * for its LogBuffer's arena is cut the same way when it's stored.
+ */
+extern long maxline;
+
+/**
+ * If non-zero, SuperLog() creates a shared memory ring of this many
+ * bytes. A child that calls superlogInit() then sends its superlog()
+ * messages through the ring instead of the pipe, avoiding a system
+ * call per message. Otherwise the pipe is used as usual.
+ */
+extern long shmringsize;
+
+/**
+ * If non-zero, LogParent() matches incoming lines against the
+ * patterns on this many worker threads, while the main thread reads
+ * the child's fds and stores the results in order. Helps keep up
+ * with a child that logs heavily on several fds.
+ */
+extern int workers;
+
+/**
+ * If set, each LogBuffer added with LogBufferAdd() is kept in a
+ * memory-mapped file in this directory, superlog.N.ring, so that the
+ * logs survive superlog being killed. Existing ring files are
+ * overwritten. Use LogRecover() to read them back.
+ */
+extern const char *persistdir;
+
+/**
+ * If set, LogParent() listens on a Unix-domain socket at this path.
+ * superlogctl uses it to get a copy of the logs, a query or a live
+ * tail from a running superlog, without clearing anything. See the
+ * notes on the control socket in libsuperlog.c for the commands.
+ */
+extern const char *ctlpath;
+
+/**
+ * If set, LogParent() writes its statistics to this file, as JSON,
+ * every statsinterval seconds and at exit. They're also printed on
+ * stderr on SIGUSR2 and at exit.
+ */
+extern const char *statsfile;
+extern int statsinterval;
+
+/**
+ * If non-zero, SuperLog() makes each pipe to the child this many
+ * bytes with F_SETPIPE_SZ, so the child can get further ahead before
+ * it blocks. Linux only. Unprivileged processes are limited to
+ * /proc/sys/fs/pipe-max-size, normally 1 Mb.
+ */
+extern long pipesize;
+
+/**
+ * What LogParent() does when a pipe from the child is seen three
+ * quarters full, i.e. the child is about to block writing its logs.
+ * STALL_WARN prints a warning on stderr, at most once a second.
+ * STALL_SHED does too, and stops echoing lines (verbose) until the
+ * pipes drain. The statistics say how long each pipe was near full.
+ */
+extern enum stallaction {STALL_IGNORE, STALL_WARN, STALL_SHED} stallaction;
+
+/**
+ * Each LogBuffer compresses its newest messages once they add up to
+ * this many bytes, so a buffer's size limit applies to the compressed
+ * logs. Zero disables compression.
+ */
+extern long blocksize;
+
+/**
+ * If non-zero, all LogBuffers share this many bytes between them.
+ * Each buffer's own limit is then only the minimum it's promised;
+ * the rest goes to the busiest buffers, and a buffer that needs room
+ * takes it back from those with lower priority. See
+ * LogBufferPriority(). Set this before calling LogBufferAlloc().
+ * It can't be used with persistdir.
+ */
+extern long membudget;
+
+/**
+ * Selects messages for LogQuery() and LogRecover().
+ */
+typedef struct {
+    int64_t since;      /* Earliest time, in ns since the epoch, or 0 */
+    int64_t until;      /* Latest time, or 0 for no limit */
+    int fd;             /* Only messages from this fd, or -1 for all */
+    const char *types;  /* Only these buffer types, e.g. "WE", or NULL */
+} LogFilter;
+
+/**
+ * Read the ring files in 'dir' and write out every message that was
+ * never dumped, merged and formatted as by LogDump(). Messages logged
+ * with SUPERLOGD() can't be rendered, since their formats aren't saved.
+ * The files aren't changed, so this also works while the superlog
+ * that wrote them is still running.
+ * @param dir   Directory given as persistdir
+ * @param file  Name of file to write logs to. If NULL, stdout is used.
+ * @param q     If not NULL, only messages that pass this filter are shown
+ * @return 0 on success, 3 = system error, 4 = unable to open output file
+ */
+extern int LogRecover(const char *dir, const char *file, const LogFilter *q);
+
+/**
+ * Write out the buffered messages that pass filter q, merged and
+ * formatted as by LogDump(), but leave the buffers as they are. Each
+ * buffer keeps a sparse index by time, so a query for recent messages
+ * doesn't read the older ones. Call from the thread that logs, e.g.
+ * between LogParent() events.
+ */
+extern void LogQuery(const LogFilter *q);
+
+/**
+ * Return the time 'duration' ago, in ns since the epoch, for a
+ * LogFilter. The duration is a number of seconds, optionally followed
+ * by s, m, h or d, e.g. "30s", "5m", "1.5h". Returns -1 if it can't be
+ * parsed.
+ */
+extern int64_t LogTimeAgo(const char *duration);
+
+/**
+ * Dump logs and clear them. The buffers are swapped for empty spares
+ * and written by a background thread, so logging carries on while the
+ * dump is written. This is why each buffer takes twice its size.
  */
 extern void LogDump();
 
+/**
+ * Wait until the dump in progress, if any, has been written.
+ */
+extern void LogDumpWait();
+
 /**
  * Return a new LogBuffer object
  * @param pat    Pattern for lines that go into this LogBuffer
  * @param type   Character to mark the type, e.g. 'D', 'I', 'W', 'E'
- * @param limit  Amount of space, in MB to allocate for this buffer
+ * @param limit  Amount of space, in MB to allocate for this buffer,
+ *               or the least it keeps if membudget is set
  * @return Logbuffer object
  *
  * Note that types 'D', 'I', 'W', 'E' are recognized by the colorizing
  * code. Any other value will be rendered in black.
+ *
+ * Here and in ExcludeAdd() and TriggerAdd(), a pattern written as
+ * "re:regex" is a regular expression; otherwise it's a plain string.
  */
 extern LogBuffer *LogBufferAlloc(const char *pat, char type, long limit);
 
@@ -106,6 +339,21 @@ extern LogBuffer *LogBufferAlloc(const char *pat, char type, long limit);
  */
 extern void LogBufferAdd(LogBuffer *lb);
 
+/**
+ * Reserve this log buffer for one child of SuperLogChildren(), before
+ * adding it. That child's lines that would go into a shared buffer of
+ * the same type go into this one instead.
+ * @param child  Number returned by ChildAdd() or ChildAdopt()
+ */
+extern void LogBufferSetChild(LogBuffer *lb, int child);
+
+/**
+ * Set a log buffer's priority for space beyond its minimum, when
+ * membudget is set. A buffer that's full takes space from buffers of
+ * lower priority. The default is 0.
+ */
+extern void LogBufferPriority(LogBuffer *lb, int priority);
+
 /**
  * Add one line to this logbuffer. Not normally called by client
  * code, but you can use it to annotate the logs if you like.
@@ -115,6 +363,13 @@ extern void LogBufferAdd(LogBuffer *lb);
  */
 extern void LogBufferAppend(LogBuffer *, long seq, const char *line, short fd);
 
+/**
+ * Like LogBufferAppend(), but for when the length of the line is
+ * already known. 'line' need not be nul-terminated.
+ */
+extern void LogBufferAppendLen(LogBuffer *, long seq, const char *line,
+    size_t len, short fd);
+
 /**
  * Clear this log buffer
  */
@@ -171,12 +426,13 @@ extern const char * TriggerTest(const char *line);
 
 /**
  * After the fork, this function is called in the parent process.
- * This function watches for input on any of the fds in pfds[*][0],
- * classifies it and logs it.
- * @param ifds  list of fds the child will be writing to
- * @param ofds  list of fds the parent will be reading from.
+ * This function watches for input on any of the fds in ifds[],
+ * classifies it and logs it. There is no limit on the number of fds.
+ * @param ofds  list of fds the child will be writing to
+ * @param ifds  list of fds the parent will be reading from.
+ * @param nfds  length of ofds[] and ifds[]
  */
-extern void LogParent(int ofds[MAX_FDS], int ifds[MAX_FDS], int nfds);
+extern void LogParent(int *ofds, int *ifds, int nfds);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,358 @@
+
+/*
+ * Benchmarks for superlog. Runs superlog's parent side against slgen
+ * for several synthetic loads, then times the buffer code directly,
+ * and writes the results as JSON.
+ *
+ * libsuperlog.c is included rather than linked, so the micro
+ * benchmarks can reach its static functions.
+ */
+
+#include "libsuperlog.c"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static const char *usage = "Benchmark superlog\n\n"
+"	usage: slbench [options]\n\n"
+"	-h		this list\n"
+"	-n N		Lines per load test (default 200000)\n"
+"	-g path		slgen program (default ./slgen)\n"
+"	-s name		Only run load tests whose names contain name\n"
+"	-m		Only run the micro benchmarks\n"
+"	-o file		Write the results to file instead of stdout\n"
+"\n"
+"Load tests report lines/s and bytes/s through superlog, superlog's\n"
+"CPU time and peak RSS, and how long slgen spent blocked in write().\n"
+"A load is ok if every line got through and, under a budget, peak RSS\n"
+"stayed below 1.25 times the budget.\n"
+"Micro benchmarks report ns per operation.\n"
+;
+
+/* One load test; the strings are slgen arguments */
+typedef struct {
+    const char *name;
+    const char *fds;
+    const char *len;
+    const char *exp;    /* Mean for exponential lengths, or NULL */
+    const char *mix;
+    long rate;          /* Lines/s, 0 for flat out */
+    int workers;
+    long blocksize;
+    long budget;        /* membudget, or 0 */
+} Load;
+
+static const Load loads[] = {
+    {"short_lines",   "2",     "20:80",    NULL,  "40,40,15,5", 0, 0, 64*1024},
+    {"three_fds",     "2,3,4", "20:400",   "120", "40,40,15,5", 0, 0, 64*1024},
+    {"long_lines",    "2",     "500:4000", NULL,  "40,40,15,5", 0, 0, 64*1024},
+    {"uncompressed",  "2,3,4", "20:400",   "120", "40,40,15,5", 0, 0, 0},
+    {"workers",       "2,3,4", "20:400",   "120", "40,40,15,5", 0, 2, 64*1024},
+    {"errors_only",   "2",     "20:200",   NULL,  "0,0,0,100",  0, 0, 64*1024},
+    {"rate_50k",      "2",     "20:200",   NULL,  "40,40,15,5", 50000, 0, 64*1024},
+    /* Both buffers recycle their own space, under a budget */
+    {"budget",        "2",     "20:400",   "120", "50,0,0,50",  0, 0, 0,
+     16*1024*1024},
+};
+
+static const char *pats[] = {" debug ", " info ", " warning ", " error "};
+static const char types[] = "DIWE";
+
+#define	SAMPLES	4096	/* Sample lines for the micro benchmarks */
+
+static char *sample[SAMPLES];
+static size_t sampleLen[SAMPLES];
+
+static double
+seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Run one load test in a child process, so that each gets a fresh
+ * libsuperlog and its own rusage. The result is a JSON object,
+ * written to fd 'out'.
+ */
+static void
+loadRun(const Load *ld, long nlines, const char *slgen, int out)
+{
+    char report[] = "/tmp/slbench.XXXXXX";
+    char nbuf[24], rbuf[24], result[1024], *argv[20];
+    int fds[16], nfds = 0, argc = 0, i, fd;
+    struct rusage ru;
+    int64_t start, elapsed;
+    long lines = 0, bytes = 0;
+    bool ok;
+    double genSecs = 0, stall = 0, maxWrite = 0;
+    const char *ptr = ld->fds;
+    FILE *fp;
+
+    if ((fd = mkstemp(report)) < 0) {
+	perror("mkstemp");
+	_exit(3);
+    }
+    close(fd);
+    do {
+	fds[nfds++] = strtol(ptr, (char **)&ptr, 10);
+    } while (*ptr++ == ',' && nfds < (int)NA(fds));
+
+    snprintf(nbuf, sizeof(nbuf), "%ld", nlines);
+    snprintf(rbuf, sizeof(rbuf), "%ld", ld->rate);
+    argv[argc++] = (char *)slgen;
+    argv[argc++] = "-n"; argv[argc++] = nbuf;
+    argv[argc++] = "-fds"; argv[argc++] = (char *)ld->fds;
+    argv[argc++] = "-len"; argv[argc++] = (char *)ld->len;
+    if (ld->exp != NULL) {
+	argv[argc++] = "-exp"; argv[argc++] = (char *)ld->exp;
+    }
+    argv[argc++] = "-mix"; argv[argc++] = (char *)ld->mix;
+    argv[argc++] = "-rate"; argv[argc++] = rbuf;
+    argv[argc++] = "-r"; argv[argc++] = report;
+    argv[argc] = NULL;
+
+    /* Same buffers as superlog -C, with its chatter out of the way */
+    membudget = ld->budget;
+    for (i=0; i<(int)NA(pats); ++i)
+	LogBufferAdd(LogBufferAlloc(pats[i], types[i], 2));
+    workers = ld->workers;
+    blocksize = ld->blocksize;
+    fd = open("/dev/null", O_WRONLY);
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+
+    start = nowNs();
+    SuperLog(fds, nfds, argv, NULL, "/dev/null");
+    elapsed = nowNs() - start;
+    getrusage(RUSAGE_SELF, &ru);
+
+    if ((fp = fopen(report, "r")) != NULL) {
+	if (fscanf(fp, "{\"lines\": %ld, \"bytes\": %ld, \"seconds\": %lf, "
+		   "\"write_stall_seconds\": %lf, \"max_write_us\": %lf}",
+		   &lines, &bytes, &genSecs, &stall, &maxWrite) != 5)
+	    lines = 0;
+	fclose(fp);
+    }
+    unlink(report);
+
+#ifndef LINUX
+    ru.ru_maxrss /= 1024;       /* Bytes, not Kb */
+#endif
+    /* A budget should hold, give or take the program and a chunk */
+    ok = lines == nlines &&
+	(ld->budget == 0 || ru.ru_maxrss * 1024 <= ld->budget / 4 * 5);
+    snprintf(result, sizeof(result),
+	"    {\"name\": \"%s\", \"lines\": %ld, \"bytes\": %ld, "
+	"\"seconds\": %.6f,\n"
+	"     \"lines_per_sec\": %.0f, \"bytes_per_sec\": %.0f, "
+	"\"parent_cpu_sec\": %.6f, \"peak_rss_kb\": %ld,\n"
+	"     \"child_seconds\": %.6f, \"child_write_stall_sec\": %.6f, "
+	"\"child_max_write_us\": %.1f, \"ok\": %s}",
+	ld->name, lines, bytes, elapsed / 1e9,
+	lines / (elapsed / 1e9), bytes / (elapsed / 1e9),
+	seconds(ru.ru_utime) + seconds(ru.ru_stime), (long)ru.ru_maxrss,
+	genSecs, stall, maxWrite, ok ? "true" : "false");
+    writeAll(out, result, strlen(result));
+}
+
+/**
+ * Make up lines like slgen's.
+ */
+static void
+samplesInit()
+{
+    int i;
+    size_t n, len;
+
+    srandom(1);
+    for (i=0; i<SAMPLES; ++i) {
+	len = 40 + random() % 120;
+	if ((sample[i] = malloc(len + 1)) == NULL) {
+	    fprintf(stderr, "Out of memory\n");
+	    exit(3);
+	}
+	n = snprintf(sample[i], len + 1, "%d%s", i, pats[random() % NA(pats)]);
+	for (; n < len; ++n)
+	    sample[i][n] = 'a' + (i + n) % 26;
+	sample[i][len] = '\0';
+	sampleLen[i] = len;
+    }
+}
+
+static void
+microReport(FILE *fp, bool *first, const char *name, long ops, int64_t ns)
+{
+    fprintf(fp, "%s    {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.1f}",
+	*first ? "" : ",\n", name, ops, (double)ns / ops);
+    *first = false;
+}
+
+static void
+lbFree(LogBuffer *lb)
+{
+    free(lb->arena);
+    free(lb->spare);
+    free(lb->unpack->buf);
+    free(lb->unpack);
+    free(lb->ckpt);
+    free(lb);
+}
+
+/**
+ * Time appending n lines to a buffer of 'mb' Mb. If 'full', the buffer
+ * is filled first, so that every append recycles space.
+ */
+static int64_t
+microAppend(long mb, long bsize, long n, bool full)
+{
+    LogBuffer *lb;
+    int64_t start;
+    long i;
+
+    blocksize = bsize;
+    if ((lb = LogBufferAlloc(NULL, 'I', mb)) == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	exit(3);
+    }
+    LogBufferInit(lb);
+    if (full)
+	for (i=0; i<n; ++i)
+	    LogBufferAppendLen(lb, i, sample[i % SAMPLES], sampleLen[i % SAMPLES], 2);
+    start = nowNs();
+    for (i=0; i<n; ++i)
+	LogBufferAppendLen(lb, i, sample[i % SAMPLES], sampleLen[i % SAMPLES], 2);
+    start = nowNs() - start;
+    lbFree(lb);
+    return start;
+}
+
+static void
+micro(FILE *fp)
+{
+    bool first = true;
+    long n = 200000, i, total = 0, sink = 0;
+    LineMatch m;
+    int64_t t;
+    FILE *null;
+    int rep;
+
+    samplesInit();
+    microReport(fp, &first, "append", n, microAppend(20, 0, n, false));
+    microReport(fp, &first, "append_compressed", n,
+		microAppend(20, 64*1024, n, false));
+    microReport(fp, &first, "recycle", n, microAppend(1, 0, n, true));
+    microReport(fp, &first, "recycle_compressed", n,
+		microAppend(1, 64*1024, n, true));
+
+    blocksize = 64*1024;
+    for (i=0; i<(int)NA(pats); ++i)
+	LogBufferAdd(LogBufferAlloc(pats[i], types[i], 2));
+    matchPrepare();
+    t = nowNs();
+    for (i=0; i<n; ++i)
+	sink += classify(sample[i % SAMPLES], sampleLen[i % SAMPLES], &m)->type;
+    microReport(fp, &first, "classify", n, nowNs() - t);
+    if (sink == 0) fprintf(stderr, "classify did nothing\n");
+
+    /* Dump the buffers, full, a few times over */
+    for (i=0; i<n; ++i) {
+	LogBuffer *lb = classify(sample[i % SAMPLES], sampleLen[i % SAMPLES], &m);
+	LogBufferAppendLen(lb, i, sample[i % SAMPLES], sampleLen[i % SAMPLES], 2);
+    }
+    if ((null = fopen("/dev/null", "w")) == NULL) {
+	perror("/dev/null");
+	exit(3);
+    }
+    dumpReserve();
+    for (i=0; i<nLogBuffer; ++i) {
+	LogBufferIterator(logbuffers[i]);
+	while (LogBufferNext(logbuffers[i]) != NULL)
+	    ++total;
+    }
+    t = nowNs();
+    for (rep=0; rep<5; ++rep) {
+	for (i=0; i<nLogBuffer; ++i)
+	    dumpSnap[i] = *logbuffers[i];
+	dumpPosition(dumpSnap, nLogBuffer, NULL);
+	dumpWrite(dumpSnap, nLogBuffer, dumpHeap, nowNs(), NULL, null, NULL);
+    }
+    microReport(fp, &first, "dump_per_line", total * 5, nowNs() - t);
+    fclose(null);
+    fputc('\n', fp);
+}
+
+int
+main(int argc, char **argv)
+{
+    long nlines = 200000;
+    const char *slgen = "./slgen";
+    const char *only = NULL;
+    const char *ofilename = NULL;
+    bool microOnly = false, first = true;
+    char date[64];
+    time_t now = time(NULL);
+    FILE *fp = stdout;
+    int i;
+
+    for (++argv; --argc > 0; ++argv)
+    {
+	if (strcmp(*argv, "-h") == 0) {
+	    fputs(usage, stdout);
+	    return 0;
+	} else if (strcmp(*argv, "-n") == 0 && --argc > 0) {
+	    nlines = atol(*++argv);
+	} else if (strcmp(*argv, "-g") == 0 && --argc > 0) {
+	    slgen = *++argv;
+	} else if (strcmp(*argv, "-s") == 0 && --argc > 0) {
+	    only = *++argv;
+	} else if (strcmp(*argv, "-m") == 0) {
+	    microOnly = true;
+	} else if (strcmp(*argv, "-o") == 0 && --argc > 0) {
+	    ofilename = *++argv;
+	} else {
+	    fprintf(stderr, "Unknown argument: %s\n", *argv);
+	    fputs(usage, stderr);
+	    return 2;
+	}
+    }
+    if (ofilename != NULL && (fp = fopen(ofilename, "w")) == NULL) {
+	perror(ofilename);
+	return 4;
+    }
+
+    strftime(date, sizeof(date), "%FT%T%z", localtime(&now));
+    fprintf(fp, "{\n  \"date\": \"%s\",\n  \"lines\": %ld,\n  \"load\": [\n",
+	date, nlines);
+    fflush(fp);
+    for (i=0; i<(int)NA(loads) && !microOnly; ++i) {
+	int pfd[2], pid, n;
+	char buffer[1024];
+
+	if (only != NULL && strstr(loads[i].name, only) == NULL)
+	    continue;
+	fprintf(stderr, "%s...\n", loads[i].name);
+	if (pipe(pfd) < 0 || (pid = fork()) < 0) {
+	    perror("fork");
+	    return 3;
+	}
+	if (pid == 0) {
+	    close(pfd[0]);
+	    loadRun(&loads[i], nlines, slgen, pfd[1]);
+	    _exit(0);
+	}
+	close(pfd[1]);
+	if (!first) fputs(",\n", fp);
+	first = false;
+	fflush(fp);
+	while ((n = read(pfd[0], buffer, sizeof(buffer))) > 0)
+	    fwrite(buffer, 1, n, fp);
+	close(pfd[0]);
+	waitpid(pid, NULL, 0);
+    }
+    fputs("\n  ],\n  \"micro\": [\n", fp);
+    fprintf(stderr, "micro benchmarks...\n");
+    micro(fp);
+    fputs("  ]\n}\n", fp);
+    return 0;
+}
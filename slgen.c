@@ -0,0 +1,161 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <stdint.h>
+
+static const char *usage = "Generate synthetic log lines, for benchmarking superlog\n\n"
+"	usage: slgen [options]\n\n"
+"	-h		this list\n"
+"	-n N		Write N lines (default 100000)\n"
+"	-fds list	Spread the lines over these fds, e.g. 2,3,4 (default 2)\n"
+"	-len min:max	Line lengths, uniformly distributed (default 20:120)\n"
+"	-exp mean	Exponentially distributed line lengths instead,\n"
+"			between min and max\n"
+"	-mix d,i,w,e	Percentages of debug, info, warning and error\n"
+"			lines (default 40,40,15,5); the rest are plain\n"
+"	-rate N		Write N lines per second, 0 = as fast as possible\n"
+"	-seed N		Random seed\n"
+"	-r file		Write a JSON report to file\n"
+"\n"
+"Each line is written with its own write(), as stderr would be. The\n"
+"report gives the time spent blocked in write(), i.e. how long the\n"
+"reader held the writer up.\n"
+;
+
+#define	NA(a)	(sizeof(a)/sizeof(a[0]))
+
+static const char *sevs[] = {" debug ", " info ", " warning ", " error "};
+
+static int64_t
+nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+    int fds[64];
+    int nfds = 0;
+    long nlines = 100000;
+    int lenmin = 20, lenmax = 120;
+    double mean = 0;
+    int mix[NA(sevs)] = {40, 40, 15, 5};
+    long rate = 0;
+    const char *report = NULL;
+    char line[65536];
+    int64_t start, elapsed, t, wait, writeNs = 0, maxWriteNs = 0;
+    long i, bytes = 0;
+    int j;
+
+    srandom(1);
+    for (++argv; --argc > 0; ++argv)
+    {
+	if (strcmp(*argv, "-h") == 0) {
+	    fputs(usage, stdout);
+	    return 0;
+	} else if (strcmp(*argv, "-n") == 0 && --argc > 0) {
+	    nlines = atol(*++argv);
+	} else if (strcmp(*argv, "-fds") == 0 && --argc > 0) {
+	    char *ptr = *++argv;
+	    do {
+		if (nfds < (int)NA(fds))
+		    fds[nfds++] = strtol(ptr, &ptr, 10);
+	    } while (*ptr++ == ',' && isdigit(*ptr));
+	} else if (strcmp(*argv, "-len") == 0 && --argc > 0) {
+	    if (sscanf(*++argv, "%d:%d", &lenmin, &lenmax) != 2) {
+		fprintf(stderr, "Bad -len: %s\n", *argv);
+		return 2;
+	    }
+	} else if (strcmp(*argv, "-exp") == 0 && --argc > 0) {
+	    mean = atof(*++argv);
+	} else if (strcmp(*argv, "-mix") == 0 && --argc > 0) {
+	    if (sscanf(*++argv, "%d,%d,%d,%d",
+		       &mix[0], &mix[1], &mix[2], &mix[3]) != 4) {
+		fprintf(stderr, "Bad -mix: %s\n", *argv);
+		return 2;
+	    }
+	} else if (strcmp(*argv, "-rate") == 0 && --argc > 0) {
+	    rate = atol(*++argv);
+	} else if (strcmp(*argv, "-seed") == 0 && --argc > 0) {
+	    srandom(atoi(*++argv));
+	} else if (strcmp(*argv, "-r") == 0 && --argc > 0) {
+	    report = *++argv;
+	} else {
+	    fprintf(stderr, "Unknown argument: %s\n", *argv);
+	    fputs(usage, stderr);
+	    return 2;
+	}
+    }
+    if (nfds == 0)
+	fds[nfds++] = 2;
+    if (lenmin < 16) lenmin = 16;
+    if (lenmax >= (int)sizeof(line)) lenmax = sizeof(line) - 1;
+    if (lenmax < lenmin) lenmax = lenmin;
+
+    start = nowNs();
+    for (i=0; i<nlines; ++i)
+    {
+	int len, pct = random() % 100, n;
+	const char *sev = " plain ";
+	ssize_t rc;
+
+	if (mean > 0)
+	    len = lenmin - mean * log(1.0 - random() / (RAND_MAX + 1.0));
+	else
+	    len = lenmin + random() % (lenmax - lenmin + 1);
+	if (len > lenmax) len = lenmax;
+	for (j=0; j<(int)NA(sevs); pct -= mix[j++])
+	    if (pct < mix[j]) {
+		sev = sevs[j];
+		break;
+	    }
+
+	/* Sequence number, severity, then filler up to len */
+	n = snprintf(line, sizeof(line), "%ld%s", i, sev);
+	for (; n < len; ++n)
+	    line[n] = 'a' + (i + n) % 26;
+	line[len] = '\n';
+
+	if (rate > 0) {
+	    wait = start + i * 1000000000 / rate - nowNs();
+	    if (wait > 0) {
+		struct timespec ts = {wait / 1000000000, wait % 1000000000};
+		nanosleep(&ts, NULL);
+	    }
+	}
+	t = nowNs();
+	while ((rc = write(fds[i % nfds], line, len + 1)) < 0 &&
+	       errno == EINTR);
+	t = nowNs() - t;
+	if (rc < 0) {
+	    perror("write");
+	    return 3;
+	}
+	writeNs += t;
+	if (t > maxWriteNs) maxWriteNs = t;
+	bytes += len + 1;
+    }
+    elapsed = nowNs() - start;
+
+    if (report != NULL) {
+	FILE *fp = fopen(report, "w");
+	if (fp == NULL) {
+	    perror(report);
+	    return 4;
+	}
+	fprintf(fp, "{\"lines\": %ld, \"bytes\": %ld, \"seconds\": %.6f, "
+		"\"write_stall_seconds\": %.6f, \"max_write_us\": %.1f}\n",
+		nlines, bytes, elapsed / 1e9, writeNs / 1e9, maxWriteNs / 1e3);
+	fclose(fp);
+    }
+    return 0;
+}
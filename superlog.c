@@ -13,17 +13,24 @@
 #include "libsuperlog.h"
 
 static const char *usage = "Collect output logs from another program\n\n"
-"	usage: superlog [options] -- cmd [args]\n\n"
+"	usage: superlog [options] -- cmd [args]\n"
+"	       superlog [options] -run name fds cmd [-run ...] [-adopt name fifo]\n"
+"	       superlog [-t] [-f] [-c|-C] [-o file] [query] -recover dir\n\n"
 "	-h		this list\n"
 "	1, 2, 3, ...	Collect output from specified fds\n"
 "	-d N		Allocate N Mb for \"debug\" messages\n"
 "	-i N		Allocate N Mb for \"info\" messages\n"
 "	-b N		Allocate N Mb for all other messages\n"
+"	-M N		Share N Mb among all buffers; -d, -i and -b become\n"
+"			the least each keeps\n"
+"	-prio d,i,b	Priorities for space beyond that (default 0,1,2)\n"
 "	-v		Also echo messages to stdout in real time\n"
 "	-f		Add fd number to messages\n"
 "	-t		Add timestamps to messages\n"
 "	-c		Color messages by fd\n"
 "	-C		Color messages by severity\n"
+"	-tid		Add client thread ids to messages\n"
+"	-ct		Color messages by client thread\n"
 "	-Ts str		Add trigger; logging stops N events after the trigger\n"
 "	-Tn N		Set N (default = 100)\n"
 "	-Tc N		Number of times trigger needs to be seen (1)\n"
@@ -31,14 +38,42 @@ static const char *usage = "Collect output logs from another program\n\n"
 "	-ipat str	Set pattern that denotes an info line\n"
 "	-wpat str	Set pattern that denotes a warning line\n"
 "	-epat str	Set pattern that denotes an error line\n"
+"	-sev how	Read severity from lines instead: glog, syslog,\n"
+"			json[:key], or col:N for the word at byte N\n"
 "	-x str		Add str to ignore patterns\n"
 "	-X file		Read ignore patterns from file, one per line\n"
+"	-rb N		Read from the child in N Kb chunks (default 64)\n"
+"	-pipe N		Make the pipes from the child N Kb (Linux)\n"
+"	-maxline N	Truncate lines over N Kb, 0 = never (default 1024)\n"
+"	-stall how	When the child is about to block on a full pipe:\n"
+"			off, warn (default), or shed to stop echoing (-v)\n"
+"	-shm N		Use an N Kb shared memory ring for superlog() messages\n"
+"	-j N		Match patterns on N worker threads\n"
+"	-z N		Compress logs in N Kb blocks, 0 = off (default 64)\n"
+"	-P dir		Keep the logs in files in dir, to survive a crash\n"
+"	-S path		Listen on socket path for superlogctl\n"
+"	-run name fds cmd\n"
+"			Run cmd with sh -c, collecting fds (e.g. 1,2);\n"
+"			repeat for more children, instead of -- cmd\n"
+"	-adopt name fifo	Also collect what a running process writes to fifo\n"
+"	-perchild	Give each child its own buffers\n"
+"	-onexit how	When one child exits: continue (default),\n"
+"			dump, or stop the others\n"
+"	-stats file	Write statistics to file as JSON every N seconds\n"
+"	-statsint N	Set N (default 10)\n"
+"	-recover dir	Show the undumped logs left in dir by -P\n"
+"	-since T	Query: only logs from the last T, e.g. 30s, 5m, 2h\n"
+"	-until T	Query: only logs from before T ago\n"
+"	-qfd N		Query: only logs from fd N\n"
+"	-types str	Query: only these buffers, e.g. WE\n"
 "	-o file		output to file\n"
 "\n"
 "By default, allocates 2MB for each class of message.\n"
 "By default, collects output on fd 2 (stderr)\n"
 "When program exits, logs messages are dumped to stdout (or specified file)\n"
 "If superlog receives SIGUSR1, it dumps the logs.\n"
+"If superlog receives SIGUSR2, it prints statistics on stderr.\n"
+"Query options filter -recover, which may be run while the -P superlog is.\n"
 "At present, the color options only work on ANSI terminals\n"
 ;
 
@@ -49,10 +84,11 @@ static const char *ipat = " info ";
 static const char *wpat = " warning ";
 static const char *epat = " error ";
 
+
 int
 main(int argc, char **argv)
 {
-    int fds[MAX_FDS];
+    int *fds = NULL;
     int nfds = 0;
     const char *ofilename = NULL;
     int dMb = 2;
@@ -63,13 +99,26 @@ main(int argc, char **argv)
     LogBuffer *other;
     int triggerN = 100;
     int triggerC = 1;
+    const char *recoverdir = NULL;
+    LogFilter query = {0, 0, -1, NULL};
+    bool filter = false;
+    int nchildren = 0;
+    bool perchild = false;
+    int prio[3] = {0, 1, 2};
+    int i;
 
     for (++argv; --argc > 0; ++argv)
     {
 	if (isdigit(**argv)) {
-	    if (nfds < NA(fds)) {
-		fds[nfds++] = atoi(*argv);
-	    }
+	    /* One or more fds, e.g. "3" or "1,2" */
+	    char *ptr = *argv;
+	    do {
+		if ((fds = realloc(fds, (nfds+1) * sizeof(*fds))) == NULL) {
+		    fprintf(stderr, "Out of memory\n");
+		    return 3;
+		}
+		fds[nfds++] = strtol(ptr, &ptr, 10);
+	    } while (*ptr++ == ',' && isdigit(*ptr));
 	} else if (strcmp(*argv, "-h") == 0) {
 	    fputs(usage, stdout);
 	    return 0;
@@ -79,6 +128,13 @@ main(int argc, char **argv)
 	    iMb = atoi(*++argv);
 	} else if (strcmp(*argv, "-b") == 0 && --argc > 0) {
 	    oMb = atoi(*++argv);
+	} else if (strcmp(*argv, "-M") == 0 && --argc > 0) {
+	    membudget = atol(*++argv) * 1024*1024;
+	} else if (strcmp(*argv, "-prio") == 0 && --argc > 0) {
+	    if (sscanf(*++argv, "%d,%d,%d", &prio[0], &prio[1], &prio[2]) != 3) {
+		fprintf(stderr, "Bad -prio: %s\n", *argv);
+		return 2;
+	    }
 	} else if (strcmp(*argv, "-o") == 0 && --argc > 0) {
 	    ofilename = *++argv;
 	} else if (strcmp(*argv, "-t") == 0) {
@@ -91,6 +147,10 @@ main(int argc, char **argv)
 	    showcolor = FDS;
 	} else if (strcmp(*argv, "-C") == 0) {
 	    showcolor = SEVERITY;
+	} else if (strcmp(*argv, "-tid") == 0) {
+	    showthreads = true;
+	} else if (strcmp(*argv, "-ct") == 0) {
+	    showcolor = THREADS;
 	} else if (strcmp(*argv, "-Ts") == 0 && --argc > 0) {
 	    TriggerAdd(*++argv);
 	} else if (strcmp(*argv, "-Tn") == 0 && --argc > 0) {
@@ -105,10 +165,120 @@ main(int argc, char **argv)
 	    wpat = *++argv;
 	} else if (strcmp(*argv, "-epat") == 0 && --argc > 0) {
 	    epat = *++argv;
+	} else if (strcmp(*argv, "-sev") == 0 && --argc > 0) {
+	    const char *how = *++argv;
+	    if (strcmp(how, "glog") == 0) {
+		sevparse = SEV_GLOG;
+	    } else if (strcmp(how, "syslog") == 0) {
+		sevparse = SEV_SYSLOG;
+	    } else if (strncmp(how, "json", 4) == 0 &&
+		       (how[4] == '\0' || how[4] == ':'))
+	    {
+		sevparse = SEV_JSON;
+		if (how[4] == ':') sevkey = how + 5;
+	    } else if (strncmp(how, "col:", 4) == 0 && isdigit(how[4])) {
+		sevparse = SEV_COLUMN;
+		sevcolumn = atoi(how + 4);
+	    } else {
+		fprintf(stderr, "Unknown -sev mode: %s\n", how);
+		fputs(usage, stderr);
+		return 2;
+	    }
 	} else if (strcmp(*argv, "-x") == 0 && --argc > 0) {
 	    ExcludeAdd(*++argv);
 	} else if (strcmp(*argv, "-X") == 0 && --argc > 0) {
 	    ExcludeAddFile(*++argv);
+	} else if (strcmp(*argv, "-rb") == 0 && --argc > 0) {
+	    readbufsize = atol(*++argv) * 1024;
+	} else if (strcmp(*argv, "-maxline") == 0 && --argc > 0) {
+	    maxline = atol(*++argv) * 1024;
+	} else if (strcmp(*argv, "-pipe") == 0 && --argc > 0) {
+	    pipesize = atol(*++argv) * 1024;
+	} else if (strcmp(*argv, "-stall") == 0 && --argc > 0) {
+	    ++argv;
+	    if (strcmp(*argv, "off") == 0)
+		stallaction = STALL_IGNORE;
+	    else if (strcmp(*argv, "warn") == 0)
+		stallaction = STALL_WARN;
+	    else if (strcmp(*argv, "shed") == 0)
+		stallaction = STALL_SHED;
+	    else {
+		fprintf(stderr, "Unknown -stall action: %s\n", *argv);
+		return 2;
+	    }
+	} else if (strcmp(*argv, "-shm") == 0 && --argc > 0) {
+	    shmringsize = atol(*++argv) * 1024;
+	} else if (strcmp(*argv, "-j") == 0 && --argc > 0) {
+	    workers = atoi(*++argv);
+	} else if (strcmp(*argv, "-z") == 0 && --argc > 0) {
+	    blocksize = atol(*++argv) * 1024;
+	} else if (strcmp(*argv, "-P") == 0 && --argc > 0) {
+	    persistdir = *++argv;
+	} else if (strcmp(*argv, "-S") == 0 && --argc > 0) {
+	    ctlpath = *++argv;
+	} else if (strcmp(*argv, "-stats") == 0 && --argc > 0) {
+	    statsfile = *++argv;
+	} else if (strcmp(*argv, "-statsint") == 0 && --argc > 0) {
+	    if ((statsinterval = atoi(*++argv)) < 1)
+		statsinterval = 1;
+	} else if (strcmp(*argv, "-run") == 0 && argc > 3) {
+	    char **cmd = malloc(4 * sizeof(*cmd));
+	    int *cfds = NULL, ncfds = 0;
+	    char *ptr = argv[2];
+	    do {
+		if ((cfds = realloc(cfds, (ncfds+1) * sizeof(*cfds))) == NULL)
+		    break;
+		cfds[ncfds++] = strtol(ptr, &ptr, 10);
+	    } while (*ptr++ == ',' && isdigit(*ptr));
+	    if (cmd == NULL || cfds == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 3;
+	    }
+	    cmd[0] = "/bin/sh";
+	    cmd[1] = "-c";
+	    cmd[2] = argv[3];
+	    cmd[3] = NULL;
+	    if (ChildAdd(argv[1], cfds, ncfds, cmd) > 0)
+		++nchildren;
+	    argv += 3;
+	    argc -= 3;
+	} else if (strcmp(*argv, "-adopt") == 0 && argc > 2) {
+	    if (ChildAdopt(argv[1], argv[2]) > 0)
+		++nchildren;
+	    argv += 2;
+	    argc -= 2;
+	} else if (strcmp(*argv, "-perchild") == 0) {
+	    perchild = true;
+	} else if (strcmp(*argv, "-onexit") == 0 && --argc > 0) {
+	    ++argv;
+	    if (strcmp(*argv, "continue") == 0)
+		childexit = CHILD_CONTINUE;
+	    else if (strcmp(*argv, "dump") == 0)
+		childexit = CHILD_DUMP;
+	    else if (strcmp(*argv, "stop") == 0)
+		childexit = CHILD_STOP;
+	    else {
+		fprintf(stderr, "Unknown -onexit action: %s\n", *argv);
+		return 2;
+	    }
+	} else if (strcmp(*argv, "-recover") == 0 && --argc > 0) {
+	    recoverdir = *++argv;
+	} else if ((strcmp(*argv, "-since") == 0 ||
+		    strcmp(*argv, "-until") == 0) && --argc > 0) {
+	    int64_t t = LogTimeAgo(argv[1]);
+	    if (t < 0) {
+		fprintf(stderr, "Bad duration for %s: %s\n", argv[0], argv[1]);
+		return 2;
+	    }
+	    if (argv[0][1] == 's') query.since = t; else query.until = t;
+	    filter = true;
+	    ++argv;
+	} else if (strcmp(*argv, "-qfd") == 0 && --argc > 0) {
+	    query.fd = atoi(*++argv);
+	    filter = true;
+	} else if (strcmp(*argv, "-types") == 0 && --argc > 0) {
+	    query.types = *++argv;
+	    filter = true;
 	} else if (strcmp(*argv, "--") == 0) {
 	    ++argv;
 	    --argc;
@@ -120,12 +290,27 @@ main(int argc, char **argv)
 	}
     }
 
-    if (argc < 1) {
-	fprintf(stderr, "command is required\n");
+    if (recoverdir != NULL)
+	return LogRecover(recoverdir, ofilename, filter ? &query : NULL);
+    if (filter) {
+	fprintf(stderr, "Query options need -recover\n");
 	fputs(usage, stderr);
 	return 2;
     }
 
+    if ((argc < 1) == (nchildren == 0)) {
+	fprintf(stderr, nchildren == 0 ? "command is required\n" :
+		"Give either -run and -adopt, or a command\n");
+	fputs(usage, stderr);
+	return 2;
+    }
+
+    if (nfds == 0) {
+	static int defaultFd = 2;
+	fds = &defaultFd;
+	nfds = 1;
+    }
+
     /* For testing purposes, the user can specify zero for a buffer
      * size, in which case we use 1000 bytes.
      */
@@ -134,16 +319,54 @@ main(int argc, char **argv)
 	fputs(usage, stderr);
 	return 2;
     }
+    if (membudget > 0 && persistdir != NULL) {
+	fprintf(stderr, "-M can't be used with -P\n");
+	return 2;
+    }
+    if (membudget > 0 && (long)(dMb + iMb + oMb) * 1024*1024 *
+	(perchild ? nchildren + 1 : 1) > membudget)
+    {
+	fprintf(stderr, "Buffer minimums add up to more than -M; "
+		"the budget will be exceeded\n");
+    }
 
     debug = LogBufferAlloc(dpat, 'D', dMb);
     info = LogBufferAlloc(ipat, 'I', iMb);
     other = LogBufferAlloc(wpat, 'W', oMb);
+    if (debug == NULL || info == NULL || other == NULL) {
+	fprintf(stderr, "Out of memory\n");
+	return 3;
+    }
+    LogBufferPriority(debug, prio[0]);
+    LogBufferPriority(info, prio[1]);
+    LogBufferPriority(other, prio[2]);
 
     LogBufferAdd(debug);
     LogBufferAdd(info);
     LogBufferAdd(other);
 
+    /* The same again for each child */
+    for (i=1; perchild && i<=nchildren; ++i) {
+	LogBuffer *lbs[3];
+	int j;
+	lbs[0] = LogBufferAlloc(dpat, 'D', dMb);
+	lbs[1] = LogBufferAlloc(ipat, 'I', iMb);
+	lbs[2] = LogBufferAlloc(wpat, 'W', oMb);
+	for (j=0; j<3; ++j) {
+	    if (lbs[j] == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 3;
+	    }
+	    LogBufferSetChild(lbs[j], i);
+	    LogBufferPriority(lbs[j], prio[j]);
+	    LogBufferAdd(lbs[j]);
+	}
+    }
+
     TriggerParams(triggerC, triggerN);
 
+    if (nchildren > 0)
+	return SuperLogChildren(ofilename);
+
     return SuperLog(fds, nfds, argv, NULL, ofilename);
 }
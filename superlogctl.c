@@ -0,0 +1,80 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char *usage = "Talk to a running superlog\n\n"
+"	usage: superlogctl socket command [args]\n\n"
+"	socket is the path given to superlog -S. Commands:\n\n"
+"	dump		Show the logs, without clearing them\n"
+"	query [since=T] [until=T] [fd=N] [types=str]\n"
+"			Show the logs from the last T (e.g. 30s, 5m, 2h),\n"
+"			from before T ago, from fd N, or from the buffers\n"
+"			whose types are in str\n"
+"	tail [fd=N] [types=str]\n"
+"			Show new messages as they're logged\n"
+"	stats		Show superlog's statistics\n"
+"	json		The same, as JSON\n"
+"	flush		Dump the logs to superlog's output and clear them\n"
+;
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char buffer[64*1024];
+    size_t len = 0;
+    ssize_t n;
+    int i, fd;
+
+    if (argc < 3 || strcmp(argv[1], "-h") == 0) {
+	fputs(usage, argc < 3 ? stderr : stdout);
+	return argc < 3 ? 2 : 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: path too long\n", argv[1]);
+	return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	return 3;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	perror(argv[1]);
+	return 3;
+    }
+
+    /* The command is the rest of the arguments, on one line */
+    for (i=2; i<argc; ++i) {
+	len += snprintf(buffer + len, sizeof(buffer) - len, "%s%s",
+			argv[i], i < argc-1 ? " " : "\n");
+	if (len >= sizeof(buffer)) {
+	    fprintf(stderr, "Command too long\n");
+	    return 2;
+	}
+    }
+    if (write(fd, buffer, len) != (ssize_t)len) {
+	perror(argv[1]);
+	return 3;
+    }
+
+    /* superlog closes the connection when it's done, except for tail */
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    perror(argv[1]);
+	    return 3;
+	}
+	if (write(1, buffer, n) != n)
+	    return 3;
+    }
+    return 0;
+}